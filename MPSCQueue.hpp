@@ -2,41 +2,3108 @@
 #ifndef GREEZEZ_MPSCQUEUE_HPP
 #define GREEZEZ_MPSCQUEUE_HPP
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// x86-64 with GCC or Clang: CPUID, target attributes and the SIMD and
+// UMWAIT kernels selected at run time. Elsewhere the portable ones are used.
+#if defined(__x86_64__) && defined(__GNUC__)
+#define GREEZEZ_MPSC_X86_KERNELS 1
+#include <cpuid.h>
+#else
+#define GREEZEZ_MPSC_X86_KERNELS 0
+#endif
+
+#ifndef GREEZEZ_MPSC_SEQ_CST
+#define GREEZEZ_MPSC_SEQ_CST 0
+#endif
+
+// Expands where a thread being descheduled opens a window for the others
+// (between claiming and publishing, and so on). Empty unless defined before
+// including this header; the stress test uses it to inject yields.
+#ifndef GREEZEZ_MPSC_STRESS_POINT
+#define GREEZEZ_MPSC_STRESS_POINT()
+#endif
+
+// Static trace points, provider greezez_mpsc: push, pop and full in the
+// engines, park and wake in wait::park. Arguments are the engine (or wait
+// strategy), the ring position or byte offset (0 for LinkedEngine, the futex
+// key for park/wake) and the size in bytes. With GREEZEZ_MPSC_USDT=1 they
+// become USDT probes from <sys/sdt.h>, a nop plus an ELF note each, that
+// bpftrace or perf can attach to in a running process. Otherwise they expand
+// to nothing, unless GREEZEZ_MPSC_PROBE is defined before including this
+// header to hook them at compile time.
+#ifndef GREEZEZ_MPSC_USDT
+#define GREEZEZ_MPSC_USDT 0
+#endif
+
+#ifndef GREEZEZ_MPSC_PROBE
+#if GREEZEZ_MPSC_USDT
+#if !__has_include(<sys/sdt.h>)
+#error "GREEZEZ_MPSC_USDT needs <sys/sdt.h> (systemtap-sdt-dev or systemtap-sdt-devel)"
+#endif
+#include <sys/sdt.h>
+#define GREEZEZ_MPSC_PROBE(name, object, position, size) STAP_PROBE3(greezez_mpsc, name, object, position, size)
+#else
+#define GREEZEZ_MPSC_PROBE(name, object, position, size)
+#endif
+#endif
+
 namespace greezez
 {
 	namespace mpsc
 	{
 
-		class Produser
+		namespace detail
+		{
+
+			inline constexpr std::size_t cache_line = 64;
+
+			// Every atomic operation in this header names one of these. They are
+			// the weakest orderings the algorithms need; building with
+			// GREEZEZ_MPSC_SEQ_CST=1 turns them all into seq_cst, to A/B a
+			// suspected ordering bug or measure what the weaker orders save.
+			inline constexpr std::memory_order mo_relaxed = GREEZEZ_MPSC_SEQ_CST ? std::memory_order_seq_cst : std::memory_order_relaxed;
+			inline constexpr std::memory_order mo_acquire = GREEZEZ_MPSC_SEQ_CST ? std::memory_order_seq_cst : std::memory_order_acquire;
+			inline constexpr std::memory_order mo_release = GREEZEZ_MPSC_SEQ_CST ? std::memory_order_seq_cst : std::memory_order_release;
+			inline constexpr std::memory_order mo_acq_rel = GREEZEZ_MPSC_SEQ_CST ? std::memory_order_seq_cst : std::memory_order_acq_rel;
+			inline constexpr std::memory_order mo_seq_cst = std::memory_order_seq_cst;
+
+			inline void cpu_relax() noexcept
+			{
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+				_mm_pause();
+#elif defined(__aarch64__)
+				asm volatile("yield" ::: "memory");
+#else
+				std::this_thread::yield();
+#endif
+			}
+
+			// The word a waiting consumer watches: the next push stores to it, and
+			// it holds empty_value until then. Engines hand this out via watch().
+			struct Watch
+			{
+				const void* word;
+				std::uint64_t empty_value;
+			};
+
+			// One round of waiting for watch.word to leave empty_value. On ARM64
+			// ldxr arms the exclusive monitor on the line and wfe sleeps until a
+			// store clears it (or the timer event stream fires, ~100us on Linux),
+			// so the core idles instead of hammering the line with loads. The
+			// leading sevl/wfe pair drops any stale event. Elsewhere it is a pause.
+			inline void wait_on(const Watch& watch) noexcept
+			{
+#if defined(__aarch64__)
+				std::uint64_t scratch;
+				asm volatile(
+					"sevl\n\t"
+					"wfe\n\t"
+					"ldxr %[scratch], %[word]\n\t"
+					"eor %[scratch], %[scratch], %[value]\n\t"
+					"cbnz %[scratch], 1f\n\t"
+					"wfe\n"
+					"1:"
+					: [scratch] "=&r"(scratch)
+					: [word] "Q"(*static_cast<const std::uint64_t*>(watch.word)), [value] "r"(watch.empty_value)
+					: "memory");
+#else
+				(void)watch;
+				cpu_relax();
+#endif
+			}
+
+			// ARM64 atomics: with LSE (armv8.1-a and later, e.g. -mcpu=neoverse-n1
+			// or -march=armv8.2-a) exchange, fetch_add and compare_exchange compile
+			// to single swp/ldadd/cas instructions instead of ldxr/stxr retry loops
+			// that livelock under contention. GCC 10+ without -march emits
+			// -moutline-atomics helpers that pick LSE at run time; lse_atomics
+			// reports whether it was compiled in directly.
+#if defined(__aarch64__) && defined(__ARM_FEATURE_ATOMICS)
+			inline constexpr bool lse_atomics = true;
+#else
+			inline constexpr bool lse_atomics = false;
+#endif
+
+			// Cheap monotonic cycle counter: TSC on x86, the virtual counter on
+			// ARM64, steady_clock nanoseconds elsewhere.
+			inline std::uint64_t tsc() noexcept
+			{
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+				return __rdtsc();
+#elif defined(__aarch64__)
+				std::uint64_t ticks;
+				asm volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+				return ticks;
+#else
+				return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+					std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+			}
+
+			// tsc() ticks per second, measured once against steady_clock where the
+			// counter frequency is not architectural.
+			inline std::uint64_t tsc_hz() noexcept
+			{
+				static const std::uint64_t hz = []
+				{
+#if defined(__aarch64__)
+					std::uint64_t frequency;
+					asm volatile("mrs %0, cntfrq_el0" : "=r"(frequency));
+					return frequency;
+#elif defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+					using clock = std::chrono::steady_clock;
+					auto start = clock::now();
+					std::uint64_t first = tsc();
+					while (clock::now() - start < std::chrono::milliseconds(10))
+					{
+					}
+					std::uint64_t ticks = tsc() - first;
+					auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+					return static_cast<std::uint64_t>(static_cast<double>(ticks) * 1e9 / static_cast<double>(elapsed));
+#else
+					return std::uint64_t(1000000000);
+#endif
+				}();
+				return hz;
+			}
+
+			inline std::uint64_t to_ticks(std::chrono::nanoseconds duration) noexcept
+			{
+				return static_cast<std::uint64_t>(static_cast<double>(duration.count()) * static_cast<double>(tsc_hz()) / 1e9);
+			}
+
+			// What the CPU and OS support, read from CPUID (and XGETBV for the
+			// vector register state) once.
+			struct CpuFeatures
+			{
+				bool avx2 = false;
+				bool avx512 = false;  // F and BW
+				bool waitpkg = false; // umonitor/umwait/tpause: Tremont, Alder Lake, Sapphire Rapids on
+			};
+
+			inline const CpuFeatures& cpu_features() noexcept
+			{
+				static const CpuFeatures features = []
+				{
+					CpuFeatures result;
+#if GREEZEZ_MPSC_X86_KERNELS
+					unsigned a, b, c, d;
+					if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & (1u << 27))) // OSXSAVE
+					{
+						return result;
+					}
+					unsigned xcr0_low, xcr0_high;
+					asm volatile("xgetbv" : "=a"(xcr0_low), "=d"(xcr0_high) : "c"(0));
+					bool ymm_state = (xcr0_low & 0x06) == 0x06;
+					bool zmm_state = (xcr0_low & 0xe6) == 0xe6;
+					if (__get_cpuid_count(7, 0, &a, &b, &c, &d))
+					{
+						result.avx2 = ymm_state && (b & (1u << 5));
+						result.avx512 = zmm_state && (b & (1u << 16)) && (b & (1u << 30));
+						result.waitpkg = (c & (1u << 5)) != 0;
+					}
+#endif
+					return result;
+				}();
+				return features;
+			}
+
+			inline void stream_portable(void* destination, const void* source, std::size_t size) noexcept
+			{
+				std::memcpy(destination, source, size);
+			}
+
+			inline void wait_portable(const Watch& watch, std::uint64_t) noexcept
+			{
+				wait_on(watch);
+			}
+
+#if GREEZEZ_MPSC_X86_KERNELS
+			// Non-temporal copies: aligned vector stores that bypass the cache,
+			// ending in sfence since they are not ordered by a later release
+			// store. Head and tail that don't fill a vector go through memcpy.
+			inline void stream_sse2(void* destination, const void* source, std::size_t size) noexcept
+			{
+				char* to = static_cast<char*>(destination);
+				const char* from = static_cast<const char*>(source);
+				std::size_t head = std::min<std::size_t>(size, (16 - reinterpret_cast<std::uintptr_t>(to) % 16) % 16);
+				std::memcpy(to, from, head);
+				to += head;
+				from += head;
+				size -= head;
+				for (; size >= 16; size -= 16, to += 16, from += 16)
+				{
+					_mm_stream_si128(reinterpret_cast<__m128i*>(to), _mm_loadu_si128(reinterpret_cast<const __m128i*>(from)));
+				}
+				std::memcpy(to, from, size);
+				_mm_sfence();
+			}
+
+			__attribute__((target("avx2"))) inline void stream_avx2(void* destination, const void* source, std::size_t size) noexcept
+			{
+				char* to = static_cast<char*>(destination);
+				const char* from = static_cast<const char*>(source);
+				std::size_t head = std::min<std::size_t>(size, (32 - reinterpret_cast<std::uintptr_t>(to) % 32) % 32);
+				std::memcpy(to, from, head);
+				to += head;
+				from += head;
+				size -= head;
+				for (; size >= 32; size -= 32, to += 32, from += 32)
+				{
+					_mm256_stream_si256(reinterpret_cast<__m256i*>(to), _mm256_loadu_si256(reinterpret_cast<const __m256i*>(from)));
+				}
+				std::memcpy(to, from, size);
+				_mm_sfence();
+			}
+
+			__attribute__((target("avx512f"))) inline void stream_avx512(void* destination, const void* source, std::size_t size) noexcept
+			{
+				char* to = static_cast<char*>(destination);
+				const char* from = static_cast<const char*>(source);
+				std::size_t head = std::min<std::size_t>(size, (64 - reinterpret_cast<std::uintptr_t>(to) % 64) % 64);
+				std::memcpy(to, from, head);
+				to += head;
+				from += head;
+				size -= head;
+				for (; size >= 64; size -= 64, to += 64, from += 64)
+				{
+					_mm512_stream_si512(reinterpret_cast<__m512i*>(to), _mm512_loadu_si512(from));
+				}
+				std::memcpy(to, from, size);
+				_mm_sfence();
+			}
+
+			// Arms the monitor on watch.word's line and, unless a push already
+			// landed, sleeps in C0.1 until the line is written or the TSC passes
+			// deadline (the OS also caps the sleep, 100k cycles by default on
+			// Linux). Only valid with WAITPKG.
+			__attribute__((target("waitpkg"))) inline void wait_umwait(const Watch& watch, std::uint64_t deadline) noexcept
+			{
+				_umonitor(const_cast<void*>(watch.word));
+				if (__atomic_load_n(static_cast<const std::uint64_t*>(watch.word), __ATOMIC_RELAXED) == watch.empty_value)
+				{
+					_umwait(1, deadline);
+				}
+			}
+#endif
+
+			// The kernels for this CPU, picked once at first use, so one binary
+			// runs the AVX-512 paths where they exist without being built per
+			// host. Plain copies are left to memcpy, which glibc already
+			// dispatches by CPU; only what it has no equivalent for is here.
+			struct Kernels
+			{
+				const char* isa;
+				void (*stream)(void* destination, const void* source, std::size_t size) noexcept;
+				void (*wait)(const Watch& watch, std::uint64_t deadline) noexcept;
+			};
+
+			inline const Kernels& kernels() noexcept
+			{
+				static const Kernels table = []
+				{
+					Kernels result{ "portable", stream_portable, wait_portable };
+#if GREEZEZ_MPSC_X86_KERNELS
+					const CpuFeatures& features = cpu_features();
+					result = { "sse2", stream_sse2, wait_portable };
+					if (features.avx512)
+					{
+						result = { "avx512", stream_avx512, wait_portable };
+					}
+					else if (features.avx2)
+					{
+						result = { "avx2", stream_avx2, wait_portable };
+					}
+					if (features.waitpkg)
+					{
+						result.wait = wait_umwait;
+					}
+#endif
+					return result;
+				}();
+				return table;
+			}
+
+		}
+
+
+
+		// Reclamation policies for LinkedEngine.
+		//
+		// ImmediateReclaim frees each node as soon as the consumer is done with it.
+		// EpochReclaim defers frees until no observer can still reach the node, so
+		// peek()/for_each() may run concurrently with the consumer from up to
+		// MaxObservers threads at a time. Frees are batched: the consumer only tries
+		// to advance the epoch once every Batch pops and then releases the whole
+		// range retired two epochs ago in one walk.
+
+		struct ImmediateReclaim
+		{
+		};
+
+		template<std::size_t MaxObservers = 8, std::size_t Batch = 4096>
+		struct EpochReclaim
+		{
+			static_assert(MaxObservers > 0, "EpochReclaim needs at least one observer slot");
+			static_assert(Batch > 0, "EpochReclaim batch must be non-zero");
+
+			static constexpr std::size_t max_observers = MaxObservers;
+			static constexpr std::size_t batch = Batch;
+		};
+
+
+
+		namespace detail
+		{
+
+			template<typename Reclaim>
+			struct is_epoch_reclaim : std::false_type
+			{
+			};
+
+			template<std::size_t MaxObservers, std::size_t Batch>
+			struct is_epoch_reclaim<EpochReclaim<MaxObservers, Batch>> : std::true_type
+			{
+			};
+
+		}
+
+
+
+		// Unbounded non-intrusive queue (Vyukov): producers swing the tail with one
+		// exchange, the consumer follows next pointers from a stub node.
+		template<typename T, typename Reclaim = ImmediateReclaim, typename Allocator = std::allocator<T>>
+		class LinkedEngine
 		{
+			static constexpr bool epoch_reclaim = detail::is_epoch_reclaim<Reclaim>::value;
+
+			static_assert(!epoch_reclaim || std::is_copy_constructible_v<T>,
+				"EpochReclaim copies values out so observers never see a moved-from object");
+
+			struct Node
+			{
+				std::atomic<Node*> next{ nullptr };
+				alignas(T) unsigned char storage[sizeof(T)];
+
+				T* value() noexcept
+				{
+					return std::launder(reinterpret_cast<T*>(storage));
+				}
+			};
+
+			using NodeAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<Node>;
+			using NodeTraits = std::allocator_traits<NodeAllocator>;
+
 		public:
-			Produser()
+			using value_type = T;
+			using allocator_type = Allocator;
+
+			explicit LinkedEngine(const Allocator& allocator = Allocator())
+				: allocator_(allocator)
+			{
+				head_.store(&stub_, detail::mo_relaxed);
+				tail_.store(&stub_, detail::mo_relaxed);
+				if constexpr (epoch_reclaim)
+				{
+					reclaim_from_ = &stub_;
+					reclaim_mark_ = &stub_;
+				}
+			}
+
+			LinkedEngine(const LinkedEngine&) = delete;
+			LinkedEngine& operator=(const LinkedEngine&) = delete;
+
+			~LinkedEngine()
+			{
+				if constexpr (epoch_reclaim)
+				{
+					dispose_range(reclaim_from_, nullptr);
+				}
+				else
+				{
+					// The head's value was already moved out by try_pop.
+					Node* head = head_.load(detail::mo_relaxed);
+					Node* next = head->next.load(detail::mo_relaxed);
+					release(head);
+					dispose_range(next, nullptr);
+				}
+			}
+
+			template<typename... Args>
+			bool try_emplace(Args&&... args)
+			{
+				Node* node = NodeTraits::allocate(allocator_, 1);
+				NodeTraits::construct(allocator_, node);
+				::new (static_cast<void*>(node->storage)) T(std::forward<Args>(args)...);
+				// acq_rel: release hands the initialised node to the next producer,
+				// which stores into its next field; acquire does the same for prev.
+				Node* prev = tail_.exchange(node, detail::mo_acq_rel);
+				GREEZEZ_MPSC_STRESS_POINT();
+				prev->next.store(node, detail::mo_release);
+				GREEZEZ_MPSC_PROBE(push, this, 0, sizeof(T));
+				return true;
+			}
+
+			// Consumer only.
+			bool empty() const noexcept
+			{
+				return head_.load(detail::mo_relaxed)->next.load(detail::mo_acquire) == nullptr;
+			}
+
+			// Consumer only. The next push links itself into head->next.
+			detail::Watch watch() const noexcept
+			{
+				return { &head_.load(detail::mo_relaxed)->next, 0 };
+			}
+
+			// Consumer only.
+			bool try_pop(T& out)
+			{
+				Node* head = head_.load(detail::mo_relaxed);
+				Node* next = head->next.load(detail::mo_acquire);
+				if (!next)
+				{
+					return false;
+				}
+
+				if constexpr (epoch_reclaim)
+				{
+					out = *next->value();
+					head_.store(next, detail::mo_release);
+					if (++retired_ >= Reclaim::batch)
+					{
+						retired_ = 0;
+						try_reclaim();
+					}
+				}
+				else
+				{
+					out = std::move(*next->value());
+					std::destroy_at(next->value());
+					head_.store(next, detail::mo_relaxed);
+					release(head);
+				}
+				GREEZEZ_MPSC_PROBE(pop, this, 0, sizeof(T));
+				return true;
+			}
+
+			// Any thread. Copies the oldest pending value without consuming it.
+			bool peek(T& out) const requires epoch_reclaim
 			{
+				ObserverGuard guard(*this);
+				Node* next = head_.load(detail::mo_seq_cst)->next.load(detail::mo_acquire);
+				if (!next)
+				{
+					return false;
+				}
+				out = *next->value();
+				return true;
 			}
 
-			~Produser()
+			// Any thread. Visits the values pending at the time of the call, oldest
+			// first, and returns how many were visited. Values pushed during the walk
+			// may or may not be seen.
+			template<typename F>
+			std::size_t for_each(F&& f) const requires epoch_reclaim
 			{
+				ObserverGuard guard(*this);
+				Node* last = tail_.load(detail::mo_acquire);
+				Node* node = head_.load(detail::mo_seq_cst);
+				std::size_t visited = 0;
+				while (node != last)
+				{
+					node = node->next.load(detail::mo_acquire);
+					if (!node)
+					{
+						break;
+					}
+					f(static_cast<const T&>(*node->value()));
+					++visited;
+				}
+				return visited;
 			}
 
 		private:
+			struct alignas(detail::cache_line) ObserverSlot
+			{
+				// 0 while free, otherwise the epoch the observer entered in.
+				std::atomic<std::uint64_t> epoch{ 0 };
+			};
+
+			struct EpochState
+			{
+				std::array<ObserverSlot, Reclaim::max_observers> slots;
+				alignas(detail::cache_line) std::atomic<std::uint64_t> epoch{ 1 };
+			};
+
+			struct NoEpochState
+			{
+			};
 
+			class ObserverGuard
+			{
+			public:
+				explicit ObserverGuard(const LinkedEngine& engine) noexcept
+				{
+					auto& state = engine.epoch_state_;
+					for (;;)
+					{
+						std::uint64_t epoch = state.epoch.load(detail::mo_seq_cst);
+						GREEZEZ_MPSC_STRESS_POINT();
+						for (auto& slot : state.slots)
+						{
+							std::uint64_t expected = 0;
+							// seq_cst: the announcement must be ordered before this
+							// observer's head load against try_reclaim's head store,
+							// fence and slot scan (store-load, so acquire/release is
+							// not enough).
+							if (slot.epoch.load(detail::mo_relaxed) == 0
+								&& slot.epoch.compare_exchange_strong(expected, epoch, detail::mo_seq_cst))
+							{
+								slot_ = &slot;
+								return;
+							}
+						}
+						detail::cpu_relax();
+					}
+				}
+
+				ObserverGuard(const ObserverGuard&) = delete;
+				ObserverGuard& operator=(const ObserverGuard&) = delete;
+
+				~ObserverGuard()
+				{
+					slot_->epoch.store(0, detail::mo_release);
+				}
+
+			private:
+				ObserverSlot* slot_ = nullptr;
+			};
+
+			void release(Node* node) noexcept
+			{
+				if (node != &stub_)
+				{
+					NodeTraits::destroy(allocator_, node);
+					NodeTraits::deallocate(allocator_, node, 1);
+				}
+			}
+
+			// Destroys the values of and frees every node in [first, last).
+			void dispose_range(Node* first, Node* last) noexcept
+			{
+				while (first != last)
+				{
+					Node* next = first->next.load(detail::mo_relaxed);
+					if (first != &stub_)
+					{
+						std::destroy_at(first->value());
+						release(first);
+					}
+					first = next;
+				}
+			}
+
+			// Nodes in [reclaim_from_, reclaim_mark_) were retired before the epoch
+			// reached its current value; once it advances again nobody can hold them.
+			void try_reclaim() noexcept
+			{
+				auto& state = epoch_state_;
+				// ThreadSanitizer ignores fences, so a -fsanitize=thread run does
+				// not check this store-load handshake with ObserverGuard; the
+				// litmus runs and GREEZEZ_MPSC_SEQ_CST builds are what cover it.
+				std::atomic_thread_fence(detail::mo_seq_cst);
+				std::uint64_t epoch = state.epoch.load(detail::mo_relaxed);
+				for (auto& slot : state.slots)
+				{
+					// acquire pairs with ObserverGuard's release on exit; the fence
+					// above already orders these loads after the head store.
+					std::uint64_t seen = slot.epoch.load(detail::mo_acquire);
+					if (seen != 0 && seen != epoch)
+					{
+						return;
+					}
+				}
+				state.epoch.store(epoch + 1, detail::mo_seq_cst);
+
+				dispose_range(reclaim_from_, reclaim_mark_);
+				reclaim_from_ = reclaim_mark_;
+				reclaim_mark_ = head_.load(detail::mo_relaxed);
+			}
+
+			// Every push allocates, so the allocator shares the producers' line.
+			alignas(detail::cache_line) std::atomic<Node*> tail_;
+			[[no_unique_address]] NodeAllocator allocator_;
+			alignas(detail::cache_line) std::atomic<Node*> head_;
+			Node* reclaim_from_ = nullptr;
+			Node* reclaim_mark_ = nullptr;
+			std::size_t retired_ = 0;
+			Node stub_;
+			mutable std::conditional_t<epoch_reclaim, EpochState, NoEpochState> epoch_state_;
 		};
 
 
 
-		class Consumer
+		// Bounded queue over a power-of-two ring. Each slot carries a sequence
+		// number (Vyukov): a producer claims position p when its slot reads p,
+		// publishes by storing p + 1, and the consumer frees it for the next lap by
+		// storing p + capacity. Sequences and values live in separate arrays so
+		// committed values stay contiguous in memory.
+		template<typename T, typename Allocator = std::allocator<T>>
+		class RingEngine
 		{
+			using Sequence = std::atomic<std::size_t>;
+			using SequenceAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<Sequence>;
+			using SequenceTraits = std::allocator_traits<SequenceAllocator>;
+			using ValueAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<T>;
+			using ValueTraits = std::allocator_traits<ValueAllocator>;
+
 		public:
-			Consumer()
+			using value_type = T;
+			using allocator_type = Allocator;
+
+			class Snapshot;
+
+			explicit RingEngine(std::size_t capacity, const Allocator& allocator = Allocator())
+				: mask_(round_capacity(capacity) - 1), sequence_allocator_(allocator), value_allocator_(allocator)
 			{
+				std::size_t size = mask_ + 1;
+				sequences_ = SequenceTraits::allocate(sequence_allocator_, size);
+				for (std::size_t i = 0; i < size; ++i)
+				{
+					SequenceTraits::construct(sequence_allocator_, sequences_ + i, i);
+				}
+				values_ = ValueTraits::allocate(value_allocator_, size);
+				tail_.store(0, detail::mo_relaxed);
 			}
 
-			~Consumer()
+			// Embedded mode: lays the ring out in caller-provided storage of at
+			// least required_bytes(capacity) bytes aligned to storage_alignment and
+			// never allocates. The storage must outlive the engine; with both in
+			// static storage or a shared mapping nothing is touched lazily at run
+			// time. Processes sharing a mapping must map it at the same address.
+			RingEngine(std::size_t capacity, std::span<std::byte> storage)
+				: mask_(round_capacity(capacity) - 1), owns_storage_(false)
+			{
+				std::size_t size = mask_ + 1;
+				if (storage.size() < required_bytes(capacity)
+					|| reinterpret_cast<std::uintptr_t>(storage.data()) % storage_alignment != 0)
+				{
+					throw std::invalid_argument("RingEngine storage is too small or misaligned");
+				}
+				sequences_ = reinterpret_cast<Sequence*>(storage.data());
+				for (std::size_t i = 0; i < size; ++i)
+				{
+					std::construct_at(sequences_ + i, i);
+				}
+				values_ = reinterpret_cast<T*>(storage.data() + values_offset(size));
+				// Fault the value pages in now rather than on the first lap.
+				std::memset(static_cast<void*>(values_), 0, size * sizeof(T));
+				tail_.store(0, detail::mo_relaxed);
+			}
+
+			RingEngine(const RingEngine&) = delete;
+			RingEngine& operator=(const RingEngine&) = delete;
+
+			~RingEngine()
+			{
+				for (std::size_t pos = head_; sequences_[pos & mask_].load(detail::mo_relaxed) == pos + 1; ++pos)
+				{
+					std::destroy_at(values_ + (pos & mask_));
+				}
+				if (!owns_storage_)
+				{
+					return;
+				}
+				std::size_t size = mask_ + 1;
+				ValueTraits::deallocate(value_allocator_, values_, size);
+				for (std::size_t i = 0; i < size; ++i)
+				{
+					SequenceTraits::destroy(sequence_allocator_, sequences_ + i);
+				}
+				SequenceTraits::deallocate(sequence_allocator_, sequences_, size);
+			}
+
+			std::size_t capacity() const noexcept
+			{
+				return mask_ + 1;
+			}
+
+			template<typename... Args>
+			bool try_emplace(Args&&... args)
+			{
+				std::size_t pos = tail_.load(detail::mo_relaxed);
+				for (;;)
+				{
+					std::size_t seq = sequences_[pos & mask_].load(detail::mo_acquire);
+					std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(seq - pos);
+					if (diff == 0)
+					{
+						// relaxed: the RMW only arbitrates ownership; the value is
+						// published by the release store of the sequence.
+						if (tail_.compare_exchange_weak(pos, pos + 1, detail::mo_relaxed))
+						{
+							break;
+						}
+					}
+					else if (diff < 0)
+					{
+						GREEZEZ_MPSC_PROBE(full, this, pos, sizeof(T));
+						return false;
+					}
+					else
+					{
+						pos = tail_.load(detail::mo_relaxed);
+					}
+				}
+				GREEZEZ_MPSC_STRESS_POINT();
+				::new (static_cast<void*>(values_ + (pos & mask_))) T(std::forward<Args>(args)...);
+				sequences_[pos & mask_].store(pos + 1, detail::mo_release);
+				GREEZEZ_MPSC_PROBE(push, this, pos, sizeof(T));
+				return true;
+			}
+
+			// Consumer only.
+			bool empty() const noexcept
+			{
+				return sequences_[head_ & mask_].load(detail::mo_acquire) != head_ + 1;
+			}
+
+			// Consumer only. The head slot's sequence stays at head until the
+			// producer that claimed it publishes.
+			detail::Watch watch() const noexcept
+			{
+				return { &sequences_[head_ & mask_], head_ };
+			}
+
+			// Consumer only.
+			bool try_pop(T& out)
+			{
+				std::size_t index = head_ & mask_;
+				if (sequences_[index].load(detail::mo_acquire) != head_ + 1)
+				{
+					return false;
+				}
+				out = std::move(values_[index]);
+				std::destroy_at(values_ + index);
+				sequences_[index].store(head_ + mask_ + 1, detail::mo_release);
+				GREEZEZ_MPSC_PROBE(pop, this, head_, sizeof(T));
+				++head_;
+				return true;
+			}
+
+			// Consumer only. The committed values at the head, at most max of them,
+			// as up to two spans over ring memory: the second is non-empty only when
+			// the run wraps past the end of the ring. The first known values are
+			// taken as already checked. Values stay in the ring until advance().
+			std::array<std::span<T>, 2> readable_spans(std::size_t max = SIZE_MAX, std::size_t known = 0) noexcept
+			{
+				std::size_t size = mask_ + 1;
+				std::size_t limit = max < size ? max : size;
+				std::size_t count = known;
+				while (count < limit
+					&& sequences_[(head_ + count) & mask_].load(detail::mo_acquire) == head_ + count + 1)
+				{
+					++count;
+				}
+				std::size_t index = head_ & mask_;
+				std::size_t first = count < size - index ? count : size - index;
+				return { std::span<T>(values_ + index, first), std::span<T>(values_, count - first) };
+			}
+
+			// Consumer only. Destroys the first count readable values and hands
+			// their slots back to producers.
+			void advance(std::size_t count) noexcept
+			{
+				for (; count != 0; --count, ++head_)
+				{
+					std::size_t index = head_ & mask_;
+					std::destroy_at(values_ + index);
+					sequences_[index].store(head_ + mask_ + 1, detail::mo_release);
+					GREEZEZ_MPSC_PROBE(pop, this, head_, sizeof(T));
+				}
+			}
+
+			// Any thread. Read-only view of the values pending at the time of the
+			// call, see Snapshot.
+			Snapshot snapshot() const requires std::is_trivially_copyable_v<T>
+			{
+				return Snapshot(*this);
+			}
+
+			static constexpr std::size_t storage_alignment = alignof(T) > detail::cache_line ? alignof(T) : detail::cache_line;
+
+			// Bytes of storage the embedded-mode constructor needs for capacity.
+			static constexpr std::size_t required_bytes(std::size_t capacity) noexcept
+			{
+				std::size_t size = round_capacity(capacity);
+				return values_offset(size) + size * sizeof(T);
+			}
+
+		private:
+			static constexpr std::size_t round_capacity(std::size_t capacity) noexcept
+			{
+				std::size_t size = 2;
+				while (size < capacity)
+				{
+					size <<= 1;
+				}
+				return size;
+			}
+
+			// Values start on their own line after the sequence array.
+			static constexpr std::size_t values_offset(std::size_t size) noexcept
+			{
+				return (size * sizeof(Sequence) + storage_alignment - 1) / storage_alignment * storage_alignment;
+			}
+
+			// Read by every push and pop; never written after construction.
+			alignas(detail::cache_line) std::size_t mask_;
+			Sequence* sequences_;
+			T* values_;
+			bool owns_storage_ = true;
+			[[no_unique_address]] SequenceAllocator sequence_allocator_;
+			[[no_unique_address]] ValueAllocator value_allocator_;
+			alignas(detail::cache_line) std::atomic<std::size_t> tail_;
+			alignas(detail::cache_line) std::size_t head_ = 0;
+		};
+
+
+
+		// Walks the last capacity() positions claimed before snapshot() was called
+		// and yields a copy of each value that is committed but not yet consumed,
+		// in FIFO order. Each copy is validated seqlock style against the slot
+		// sequence, so a value consumed or overwritten mid-read is skipped rather
+		// than torn. Nothing is written to the ring: producers and the consumer
+		// only pay for the cache lines the walk reads.
+		template<typename T, typename Allocator>
+		class RingEngine<T, Allocator>::Snapshot
+		{
+		public:
+			class iterator
+			{
+			public:
+				using value_type = T;
+				using difference_type = std::ptrdiff_t;
+
+				iterator() = default;
+
+				const T& operator*() const noexcept
+				{
+					return *std::launder(reinterpret_cast<const T*>(value_));
+				}
+
+				const T* operator->() const noexcept
+				{
+					return &**this;
+				}
+
+				iterator& operator++() noexcept
+				{
+					++pos_;
+					settle();
+					return *this;
+				}
+
+				void operator++(int) noexcept
+				{
+					++*this;
+				}
+
+				friend bool operator==(const iterator& it, std::default_sentinel_t) noexcept
+				{
+					return it.pos_ == it.end_;
+				}
+
+			private:
+				friend class Snapshot;
+
+				iterator(const RingEngine* engine, std::size_t pos, std::size_t end) noexcept
+					: engine_(engine), pos_(pos), end_(end)
+				{
+					settle();
+				}
+
+				// Moves to the first position at or after pos_ holding a committed,
+				// unconsumed value and copies it out.
+				void settle() noexcept
+				{
+					for (; pos_ != end_; ++pos_)
+					{
+						std::size_t index = pos_ & engine_->mask_;
+						const std::atomic<std::size_t>& sequence = engine_->sequences_[index];
+						if (sequence.load(detail::mo_acquire) != pos_ + 1)
+						{
+							continue;
+						}
+						std::memcpy(value_, static_cast<const void*>(engine_->values_ + index), sizeof(T));
+						std::atomic_thread_fence(detail::mo_acquire);
+						if (sequence.load(detail::mo_relaxed) == pos_ + 1)
+						{
+							return;
+						}
+					}
+				}
+
+				const RingEngine* engine_ = nullptr;
+				std::size_t pos_ = 0;
+				std::size_t end_ = 0;
+				alignas(T) unsigned char value_[sizeof(T)];
+			};
+
+			iterator begin() const noexcept
 			{
+				return iterator(engine_, begin_, end_);
+			}
+
+			std::default_sentinel_t end() const noexcept
+			{
+				return {};
+			}
+
+		private:
+			friend class RingEngine;
+
+			explicit Snapshot(const RingEngine& engine) noexcept
+				: engine_(&engine)
+			{
+				// Only bounds the walk; each slot is synchronised through its sequence.
+				end_ = engine.tail_.load(detail::mo_relaxed);
+				std::size_t size = engine.capacity();
+				begin_ = end_ > size ? end_ - size : 0;
+			}
+
+			const RingEngine* engine_;
+			std::size_t begin_;
+			std::size_t end_;
+		};
+
+
+
+		enum class CommitOrder
+		{
+			// Records are consumed strictly in claim order.
+			in_order,
+			// The consumer may consume records committed after a claimed but not
+			// yet committed one, and returns to it once it is committed.
+			any,
+		};
+
+		// Bounded queue of variable-length byte records. A producer claims room
+		// with one CAS on the tail, writes the record in place and commits it;
+		// the consumer reads committed records straight out of the ring.
+		//
+		// Each record is an 8-byte header followed by its payload, padded to 8
+		// bytes. The header holds the payload length and a state (claimed,
+		// committed, or padding when a claim skips the end of the ring).
+		// Released records are zeroed, so a zero header marks the end of what
+		// has been claimed. The header is written after the claim, so in order
+		// a producer preempted in between holds back every record behind its own
+		// until it runs again.
+		//
+		// With CommitOrder::any the consumer skips over claimed-but-uncommitted
+		// records, consuming what is committed behind them, and marks what it
+		// consumed in a bitmap with one bit per 8-byte unit. A claim is first
+		// recorded in a side table, one word per 8-byte unit tagged with the lap (as
+		// much memory again as the ring), and only then moves the tail (other
+		// producers finish moving it for a claimant that stalls), so the consumer
+		// can step over a record whose header is not written yet. Space is still
+		// handed back to producers in order, once the gap is committed and consumed
+		// as well. There is no FIFO guarantee across producers in this mode, and a
+		// producer holding several reservations at once may see them consumed in
+		// commit order rather than claim order.
+		template<CommitOrder Order = CommitOrder::in_order, typename Allocator = std::allocator<std::byte>>
+		class ByteRing
+		{
+			using ByteAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<std::byte>;
+			using ByteTraits = std::allocator_traits<ByteAllocator>;
+			using WordAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<std::uint64_t>;
+			using WordTraits = std::allocator_traits<WordAllocator>;
+
+			static constexpr std::size_t header_size = sizeof(std::uint64_t);
+			static constexpr std::uint64_t state_mask = 3;
+			static constexpr std::uint64_t claimed = 1;
+			static constexpr std::uint64_t committed = 2;
+			static constexpr std::uint64_t padding = 3;
+
+		public:
+			using allocator_type = Allocator;
+
+			explicit ByteRing(std::size_t capacity, const Allocator& allocator = Allocator())
+				: mask_(round_capacity(capacity) - 1), byte_allocator_(allocator), word_allocator_(allocator)
+			{
+				std::size_t size = mask_ + 1;
+				// Over-allocate so the ring can start on a cache line.
+				raw_ = ByteTraits::allocate(byte_allocator_, size + detail::cache_line);
+				std::uintptr_t address = reinterpret_cast<std::uintptr_t>(raw_);
+				data_ = raw_ + ((detail::cache_line - address % detail::cache_line) % detail::cache_line);
+				std::memset(data_, 0, size);
+				if constexpr (Order == CommitOrder::any)
+				{
+					consumed_ = WordTraits::allocate(word_allocator_, bitmap_words());
+					std::fill_n(consumed_, bitmap_words(), std::uint64_t(0));
+					claims_ = WordTraits::allocate(word_allocator_, size / header_size);
+					std::fill_n(claims_, size / header_size, std::uint64_t(0));
+				}
+				tail_.store(0, detail::mo_relaxed);
+				released_.store(0, detail::mo_relaxed);
+			}
+
+			ByteRing(const ByteRing&) = delete;
+			ByteRing& operator=(const ByteRing&) = delete;
+
+			~ByteRing()
+			{
+				if constexpr (Order == CommitOrder::any)
+				{
+					WordTraits::deallocate(word_allocator_, consumed_, bitmap_words());
+					WordTraits::deallocate(word_allocator_, claims_, capacity() / header_size);
+				}
+				ByteTraits::deallocate(byte_allocator_, raw_, mask_ + 1 + detail::cache_line);
+			}
+
+			std::size_t capacity() const noexcept
+			{
+				return mask_ + 1;
+			}
+
+			// Largest payload a single record can carry.
+			std::size_t max_record() const noexcept
+			{
+				return capacity() / 2 - header_size;
+			}
+
+			// Any producer. Claims room for a size-byte record and returns it to be
+			// filled and passed to commit(); returns an empty span if the ring is
+			// full or size exceeds max_record().
+			std::span<std::byte> try_reserve(std::size_t size) noexcept
+			{
+				if (size == 0 || size > max_record())
+				{
+					return {};
+				}
+				std::size_t need = record_size(size);
+				std::size_t pos = tail_.load(detail::mo_acquire);
+				std::size_t total;
+				for (;;)
+				{
+					std::size_t contiguous = capacity() - (pos & mask_);
+					total = need <= contiguous ? need : contiguous + need;
+					std::size_t released = released_.load(detail::mo_acquire);
+					if (released > pos)
+					{
+						// pos went stale while the consumer released past it; the
+						// unsigned distance below would wrap and report full.
+						pos = tail_.load(detail::mo_acquire);
+						continue;
+					}
+					if (pos + total - released > capacity())
+					{
+						GREEZEZ_MPSC_PROBE(full, this, pos & mask_, size);
+						return {};
+					}
+					if constexpr (Order == CommitOrder::any)
+					{
+						if (try_claim(pos, total))
+						{
+							break;
+						}
+					}
+					else if (tail_.compare_exchange_weak(pos, pos + total, detail::mo_relaxed))
+					{
+						break;
+					}
+				}
+
+				GREEZEZ_MPSC_STRESS_POINT();
+				std::size_t offset = pos & mask_;
+				if (total != need)
+				{
+					// The record header first, so a consumer that gets past the
+					// padding finds it. release on the padding even though no
+					// payload follows: the consumer zeroes these bytes, which must
+					// not race with this store.
+					header(0).store((std::uint64_t(size) << 2) | claimed, detail::mo_release);
+					header(offset).store((std::uint64_t(total - need) << 2) | padding, detail::mo_release);
+					return { data_ + header_size, size };
+				}
+				header(offset).store((std::uint64_t(size) << 2) | claimed, detail::mo_release);
+				return { data_ + offset + header_size, size };
+			}
+
+			// Publishes a record obtained from try_reserve.
+			void commit(std::span<std::byte> record) noexcept
+			{
+				std::size_t offset = static_cast<std::size_t>(record.data() - data_) - header_size;
+				header(offset).store((std::uint64_t(record.size()) << 2) | committed, detail::mo_release);
+				GREEZEZ_MPSC_PROBE(push, this, offset, record.size());
+			}
+
+			// Any producer. Copies bytes into a new record.
+			bool try_push(std::span<const std::byte> bytes) noexcept
+			{
+				std::span<std::byte> record = try_reserve(bytes.size());
+				if (record.empty())
+				{
+					return false;
+				}
+				std::memcpy(record.data(), bytes.data(), bytes.size());
+				GREEZEZ_MPSC_STRESS_POINT();
+				commit(record);
+				return true;
+			}
+
+			// Any producer. As try_push, but with non-temporal stores that skip
+			// the producer's caches: for large records the producer won't touch
+			// again and the consumer won't read right away, so they don't evict
+			// the producer's working set.
+			bool try_push_streaming(std::span<const std::byte> bytes) noexcept
+			{
+				std::span<std::byte> record = try_reserve(bytes.size());
+				if (record.empty())
+				{
+					return false;
+				}
+				detail::kernels().stream(record.data(), bytes.data(), bytes.size());
+				GREEZEZ_MPSC_STRESS_POINT();
+				commit(record);
+				return true;
+			}
+
+			// Consumer only. Calls f(std::span<const std::byte>) for up to max
+			// committed records and returns how many were consumed. The span is
+			// only valid during the call.
+			template<typename F>
+			std::size_t consume(F&& f, std::size_t max = SIZE_MAX)
+			{
+				std::size_t start = head_;
+				std::size_t count = 0;
+				if constexpr (Order == CommitOrder::in_order)
+				{
+					while (count < max)
+					{
+						std::uint64_t word = header(head_ & mask_).load(detail::mo_acquire);
+						std::uint64_t state = word & state_mask;
+						if (state != committed && state != padding)
+						{
+							break;
+						}
+						if (state == committed)
+						{
+							f(payload(head_ & mask_, word));
+							GREEZEZ_MPSC_PROBE(pop, this, head_ & mask_, word >> 2);
+							++count;
+						}
+						release_front(word);
+					}
+				}
+				else
+				{
+					std::size_t pos = head_;
+					bool contiguous = true;
+					// A full ring has no zero header to stop at; stop after one lap.
+					while (count < max && pos - start < capacity())
+					{
+						std::size_t offset = pos & mask_;
+						std::uint64_t word = header(offset).load(detail::mo_acquire);
+						std::uint64_t state = word & state_mask;
+						if (word == 0)
+						{
+							// Claimed, header not written yet: step over the claim.
+							std::uint64_t claim = claim_word(offset).load(detail::mo_acquire);
+							if (!claimed_at(claim, pos))
+							{
+								break;
+							}
+							contiguous = false;
+							pos += claim_stride(claim);
+							continue;
+						}
+						if (state == committed && !is_consumed(offset))
+						{
+							f(payload(offset, word));
+							GREEZEZ_MPSC_PROBE(pop, this, offset, word >> 2);
+							++count;
+							mark_consumed(offset);
+						}
+						else if (state == claimed)
+						{
+							contiguous = false;
+						}
+						if (contiguous && state != claimed)
+						{
+							clear_consumed(offset);
+							release_front(word);
+						}
+						pos += stride(word);
+					}
+				}
+				if (head_ != start)
+				{
+					released_.store(head_, detail::mo_release);
+				}
+				return count;
 			}
 
 		private:
+			static constexpr std::size_t round_capacity(std::size_t capacity) noexcept
+			{
+				std::size_t size = detail::cache_line;
+				while (size < capacity)
+				{
+					size <<= 1;
+				}
+				return size;
+			}
+
+			static constexpr std::size_t record_size(std::size_t size) noexcept
+			{
+				return (header_size + size + header_size - 1) & ~(header_size - 1);
+			}
+
+			// Bytes from this header to the next one.
+			static std::size_t stride(std::uint64_t word) noexcept
+			{
+				std::size_t length = static_cast<std::size_t>(word >> 2);
+				return (word & state_mask) == padding ? length : record_size(length);
+			}
+
+			std::atomic_ref<std::uint64_t> header(std::size_t offset) const noexcept
+			{
+				return std::atomic_ref<std::uint64_t>(*reinterpret_cast<std::uint64_t*>(data_ + offset));
+			}
+
+			std::span<const std::byte> payload(std::size_t offset, std::uint64_t word) const noexcept
+			{
+				return { data_ + offset + header_size, static_cast<std::size_t>(word >> 2) };
+			}
+
+			// Zeroes the record at the head so its bytes read as unclaimed on the
+			// next lap, and moves the head past it.
+			void release_front(std::uint64_t word) noexcept
+			{
+				std::size_t size = stride(word);
+				std::memset(data_ + (head_ & mask_), 0, size);
+				head_ += size;
+			}
+
+			std::size_t bitmap_words() const noexcept
+			{
+				return (capacity() / header_size + 63) / 64;
+			}
+
+			bool is_consumed(std::size_t offset) const noexcept
+			{
+				std::size_t unit = offset / header_size;
+				return (consumed_[unit / 64] >> (unit % 64)) & 1;
+			}
+
+			void mark_consumed(std::size_t offset) noexcept
+			{
+				std::size_t unit = offset / header_size;
+				consumed_[unit / 64] |= std::uint64_t(1) << (unit % 64);
+			}
+
+			void clear_consumed(std::size_t offset) noexcept
+			{
+				std::size_t unit = offset / header_size;
+				consumed_[unit / 64] &= ~(std::uint64_t(1) << (unit % 64));
+			}
+
+			// Claim words: the lap of the claim plus one in the high half (so the
+			// zeroed table claims nothing), its stride in 8-byte units below.
+			std::atomic_ref<std::uint64_t> claim_word(std::size_t offset) const noexcept
+			{
+				return std::atomic_ref<std::uint64_t>(claims_[offset / header_size]);
+			}
+
+			std::uint32_t lap_tag(std::size_t pos) const noexcept
+			{
+				return static_cast<std::uint32_t>(pos >> std::countr_zero(capacity())) + 1;
+			}
+
+			bool claimed_at(std::uint64_t claim, std::size_t pos) const noexcept
+			{
+				return static_cast<std::uint32_t>(claim >> 32) == lap_tag(pos) && static_cast<std::uint32_t>(claim) != 0;
+			}
+
+			static std::size_t claim_stride(std::uint64_t claim) noexcept
+			{
+				return static_cast<std::size_t>(static_cast<std::uint32_t>(claim)) * header_size;
+			}
+
+			// Claims total bytes at pos by writing its claim word, then moves the
+			// tail. If pos is already claimed, helps move the tail past it (the
+			// claimant may be preempted) and returns false with pos reloaded.
+			bool try_claim(std::size_t& pos, std::size_t total) noexcept
+			{
+				std::atomic_ref<std::uint64_t> word = claim_word(pos & mask_);
+				std::uint64_t seen = word.load(detail::mo_acquire);
+				// A newer lap's claim means pos is stale; it reloads below.
+				if (static_cast<std::int32_t>(static_cast<std::uint32_t>(seen >> 32) - lap_tag(pos)) < 0 || static_cast<std::uint32_t>(seen) == 0)
+				{
+					std::uint64_t mine = (std::uint64_t(lap_tag(pos)) << 32) | (total / header_size);
+					if (word.compare_exchange_strong(seen, mine, detail::mo_acq_rel, detail::mo_acquire))
+					{
+						std::size_t expected = pos;
+						tail_.compare_exchange_strong(expected, pos + total, detail::mo_acq_rel, detail::mo_relaxed);
+						return true;
+					}
+				}
+				if (claimed_at(seen, pos))
+				{
+					std::size_t expected = pos;
+					tail_.compare_exchange_strong(expected, pos + claim_stride(seen), detail::mo_acq_rel, detail::mo_relaxed);
+				}
+				pos = tail_.load(detail::mo_acquire);
+				return false;
+			}
+
+			// Read by producers on every reserve; never written after construction.
+			alignas(detail::cache_line) std::size_t mask_;
+			std::byte* raw_;
+			std::byte* data_;
+			std::uint64_t* claims_ = nullptr;
+			[[no_unique_address]] ByteAllocator byte_allocator_;
+			[[no_unique_address]] WordAllocator word_allocator_;
+			alignas(detail::cache_line) std::atomic<std::size_t> tail_;
+			alignas(detail::cache_line) std::atomic<std::size_t> released_;
+			alignas(detail::cache_line) std::size_t head_ = 0;
+			std::uint64_t* consumed_ = nullptr;
+		};
+
+
+
+		// Produser stages run on the producing thread before a push reaches the
+		// shared queue. A stage provides admit() and/or admit(id) to accept or
+		// reject a push, and commit() and/or commit(id) which run only after the
+		// queue accepted it. An optional abort() runs on every stage when a push
+		// does not go through, whether a stage rejected it or the queue was full.
+		// Stages without a keyed overload fall back to the unkeyed one; stages
+		// without an unkeyed overload let unkeyed pushes pass.
+
+		// Drops pushes whose id was already pushed by this Produser. Ids live in a
+		// set-associative table of Capacity entries, Ways ids (up to 8, one cache
+		// line) per bucket with round-robin replacement, so a lookup touches a
+		// single line.
+		// The table is bounded: an id evicted by newer ones is no longer detected.
+		template<std::size_t Capacity = 4096, std::size_t Ways = 8>
+		class Dedup
+		{
+			static_assert(Ways > 0 && (Ways & (Ways - 1)) == 0, "Dedup ways must be a power of two");
+			static_assert(Ways * sizeof(std::uint64_t) <= detail::cache_line, "Dedup bucket must fit in one cache line");
+			static_assert(Capacity >= Ways && Capacity % Ways == 0, "Dedup capacity must be a multiple of ways");
+			static_assert(((Capacity / Ways) & (Capacity / Ways - 1)) == 0, "Dedup bucket count must be a power of two");
+
+			static constexpr std::size_t bucket_count = Capacity / Ways;
+
+			struct alignas(detail::cache_line) Bucket
+			{
+				// 0 marks an empty way; id 0 is tracked by zero_seen_.
+				std::uint64_t ids[Ways] = {};
+			};
+
+		public:
+			Dedup()
+				: buckets_(new Bucket[bucket_count]), victims_(new std::uint8_t[bucket_count]())
+			{
+			}
+
+			bool admit(std::uint64_t id) noexcept
+			{
+				if (contains(id))
+				{
+					++duplicates_;
+					return false;
+				}
+				return true;
+			}
+
+			void commit(std::uint64_t id) noexcept
+			{
+				if (id == 0)
+				{
+					zero_seen_ = true;
+					return;
+				}
+				std::size_t bucket = index(id);
+				std::uint8_t& victim = victims_[bucket];
+				buckets_[bucket].ids[victim] = id;
+				victim = static_cast<std::uint8_t>((victim + 1) & (Ways - 1));
+			}
+
+			bool contains(std::uint64_t id) const noexcept
+			{
+				if (id == 0)
+				{
+					return zero_seen_;
+				}
+				const Bucket& bucket = buckets_[index(id)];
+				bool found = false;
+				for (std::size_t way = 0; way < Ways; ++way)
+				{
+					found |= bucket.ids[way] == id;
+				}
+				return found;
+			}
+
+			// Pushes rejected as duplicates so far.
+			std::uint64_t duplicates() const noexcept
+			{
+				return duplicates_;
+			}
+
+		private:
+			static std::size_t index(std::uint64_t id) noexcept
+			{
+				// murmur3 finalizer: ids are often sequential, spread them out.
+				id ^= id >> 33;
+				id *= 0xff51afd7ed558ccdull;
+				id ^= id >> 33;
+				id *= 0xc4ceb9fe1a85ec53ull;
+				id ^= id >> 33;
+				return static_cast<std::size_t>(id) & (bucket_count - 1);
+			}
+
+			std::unique_ptr<Bucket[]> buckets_;
+			std::unique_ptr<std::uint8_t[]> victims_;
+			std::uint64_t duplicates_ = 0;
+			bool zero_seen_ = false;
+		};
+
+
+
+		enum class OverLimit
+		{
+			fail,
+			delay,
+		};
+
+		// Per-producer token bucket. Credit is kept in tsc() ticks and refilled
+		// from the counter on each push, so admission is a subtraction and a
+		// compare on producer-local state. Over the limit a push either fails
+		// (OverLimit::fail) or spins until a token is available (OverLimit::delay).
+		template<OverLimit Action = OverLimit::fail>
+		class TokenBucket
+		{
+		public:
+			// Throws std::invalid_argument unless rate_per_second is positive and
+			// burst is not negative. A burst below one still admits one push.
+			TokenBucket(double rate_per_second, double burst)
+				: cost_(ticks_per_token(rate_per_second, burst)),
+				  limit_(burst_ticks(burst, cost_)),
+				  credit_(limit_),
+				  last_(detail::tsc())
+			{
+			}
+
+			bool admit() noexcept
+			{
+				refill();
+				if (credit_ >= cost_)
+				{
+					return true;
+				}
+				if constexpr (Action == OverLimit::delay)
+				{
+					do
+					{
+						detail::cpu_relax();
+						refill();
+					} while (credit_ < cost_);
+					return true;
+				}
+				else
+				{
+					++limited_;
+					return false;
+				}
+			}
+
+			void commit() noexcept
+			{
+				credit_ -= cost_;
+			}
+
+			// Pushes rejected for being over the limit so far.
+			std::uint64_t limited() const noexcept
+			{
+				return limited_;
+			}
+
+		private:
+			static std::uint64_t ticks_per_token(double rate_per_second, double burst)
+			{
+				if (!(rate_per_second > 0) || !(burst >= 0))
+				{
+					throw std::invalid_argument("TokenBucket needs a positive rate and a non-negative burst");
+				}
+				std::uint64_t ticks = clamp_ticks(static_cast<double>(detail::tsc_hz()) / rate_per_second);
+				return ticks == 0 ? 1 : ticks;
+			}
+
+			static std::uint64_t burst_ticks(double burst, std::uint64_t cost) noexcept
+			{
+				std::uint64_t limit = clamp_ticks(burst * static_cast<double>(cost));
+				return limit < cost ? cost : limit;
+			}
+
+			// Kept well below the range so refill() cannot overflow.
+			static std::uint64_t clamp_ticks(double ticks) noexcept
+			{
+				constexpr std::uint64_t most = UINT64_MAX / 4;
+				return ticks < static_cast<double>(most) ? static_cast<std::uint64_t>(ticks) : most;
+			}
+
+			void refill() noexcept
+			{
+				std::uint64_t now = detail::tsc();
+				std::uint64_t credit = credit_ + (now - last_);
+				credit_ = credit < limit_ ? credit : limit_;
+				last_ = now;
+			}
+
+			std::uint64_t cost_;
+			std::uint64_t limit_;
+			std::uint64_t credit_;
+			std::uint64_t last_;
+			std::uint64_t limited_ = 0;
+		};
+
+
+
+		namespace detail
+		{
+
+			template<typename Stage>
+			bool stage_admit(Stage& stage) noexcept
+			{
+				if constexpr (requires { stage.admit(); })
+				{
+					return stage.admit();
+				}
+				else
+				{
+					return true;
+				}
+			}
+
+			template<typename Stage>
+			bool stage_admit(Stage& stage, std::uint64_t id) noexcept
+			{
+				if constexpr (requires { stage.admit(id); })
+				{
+					return stage.admit(id);
+				}
+				else
+				{
+					return stage_admit(stage);
+				}
+			}
+
+			template<typename Stage>
+			void stage_commit(Stage& stage) noexcept
+			{
+				if constexpr (requires { stage.commit(); })
+				{
+					stage.commit();
+				}
+			}
+
+			template<typename Stage>
+			void stage_commit(Stage& stage, std::uint64_t id) noexcept
+			{
+				if constexpr (requires { stage.commit(id); })
+				{
+					stage.commit(id);
+				}
+				else
+				{
+					stage_commit(stage);
+				}
+			}
+
+			template<typename Stage>
+			void stage_abort(Stage& stage) noexcept
+			{
+				if constexpr (requires { stage.abort(); })
+				{
+					stage.abort();
+				}
+			}
+
+		}
+
+
+
+		template<typename Queue, typename... Stages>
+		class Produser
+		{
+		public:
+			using value_type = typename Queue::value_type;
+
+			explicit Produser(Queue& queue)
+				: queue_(&queue)
+			{
+			}
+
+			Produser(Queue& queue, Stages... stages) requires (sizeof...(Stages) > 0)
+				: queue_(&queue), stages_(std::move(stages)...)
+			{
+			}
+
+			bool push(const value_type& value)
+			{
+				return emplace(value);
+			}
+
+			bool push(value_type&& value)
+			{
+				return emplace(std::move(value));
+			}
+
+			template<typename... Args>
+			bool emplace(Args&&... args)
+			{
+				bool admitted = std::apply([](Stages&... stages) { return (detail::stage_admit(stages) && ...); }, stages_);
+				if (!admitted || !queue_->try_emplace(std::forward<Args>(args)...))
+				{
+					std::apply([](Stages&... stages) { (detail::stage_abort(stages), ...); }, stages_);
+					return false;
+				}
+				std::apply([](Stages&... stages) { (detail::stage_commit(stages), ...); }, stages_);
+				return true;
+			}
+
+			// Same as push, but stages see the producer-supplied id (see Dedup).
+			template<typename V>
+			bool push_keyed(std::uint64_t id, V&& value)
+			{
+				bool admitted = std::apply([id](Stages&... stages) { return (detail::stage_admit(stages, id) && ...); }, stages_);
+				if (!admitted || !queue_->try_emplace(std::forward<V>(value)))
+				{
+					std::apply([](Stages&... stages) { (detail::stage_abort(stages), ...); }, stages_);
+					return false;
+				}
+				std::apply([id](Stages&... stages) { (detail::stage_commit(stages, id), ...); }, stages_);
+				return true;
+			}
+
+			template<typename Stage>
+			Stage& stage() noexcept
+			{
+				return std::get<Stage>(stages_);
+			}
+
+		private:
+			Queue* queue_;
+			std::tuple<Stages...> stages_;
+		};
+
+
+
+		// Value wrapper carrying its enqueue time in tsc() ticks. The timestamp is
+		// taken when the queue constructs the value in place, so
+		// produser.emplace(args...) stamps at the moment of the push.
+		template<typename T>
+		struct Stamped
+		{
+			std::uint64_t enqueued = 0;
+			bool marked = false;
+			T value{};
+
+			Stamped() = default;
+
+			template<typename... Args>
+			explicit Stamped(std::in_place_t, Args&&... args)
+				: enqueued(detail::tsc()), value(std::forward<Args>(args)...)
+			{
+			}
+
+			template<typename U>
+				requires std::is_constructible_v<T, U&&> && (!std::is_same_v<std::remove_cvref_t<U>, Stamped>)
+			explicit Stamped(U&& value)
+				: enqueued(detail::tsc()), value(std::forward<U>(value))
+			{
+			}
+		};
+
+
+
+		// Overload flag written by the consumer's AQM on state changes only and
+		// read by producers through ShedGate, so it stays a shared, clean line
+		// while the state is steady.
+		struct alignas(detail::cache_line) ShedSignal
+		{
+			std::atomic<bool> shedding{ false };
+		};
+
+		// Produser stage rejecting pushes while the consumer asks to shed load.
+		class ShedGate
+		{
+		public:
+			explicit ShedGate(const ShedSignal& signal) noexcept
+				: signal_(&signal)
+			{
+			}
+
+			bool admit() const noexcept
+			{
+				return !signal_->shedding.load(detail::mo_relaxed);
+			}
+
+		private:
+			const ShedSignal* signal_;
+		};
+
+
+
+		// Consumer AQM policies see every popped value before it is handed out and
+		// return false to drop it; idle() runs when a pop finds the queue empty.
+
+		struct NoAqm
+		{
+			template<typename V>
+			bool deliver(V&) noexcept
+			{
+				return true;
+			}
+
+			void idle() noexcept
+			{
+			}
+		};
+
+		enum class AqmAction
+		{
+			drop,
+			mark,
+		};
+
+		// CoDel (RFC 8289) over Stamped values. Once the sojourn time has stayed
+		// above target for a whole interval, the consumer enters the dropping
+		// state and drops (or marks) values at times interval / sqrt(count), so
+		// the rate increases until the sojourn falls below target again. While
+		// dropping, the optional ShedSignal tells producers to back off.
+		template<AqmAction Action = AqmAction::drop>
+		class CoDel
+		{
+		public:
+			explicit CoDel(std::chrono::nanoseconds target = std::chrono::milliseconds(5),
+				std::chrono::nanoseconds interval = std::chrono::milliseconds(100),
+				ShedSignal* signal = nullptr) noexcept
+				: target_(detail::to_ticks(target)), interval_(detail::to_ticks(interval)), signal_(signal)
+			{
+			}
+
+			template<typename T>
+			bool deliver(Stamped<T>& item) noexcept
+			{
+				std::uint64_t now = detail::tsc();
+				std::uint64_t sojourn = now > item.enqueued ? now - item.enqueued : 0;
+				bool above = over_target(sojourn, now);
+
+				if (dropping_)
+				{
+					if (!above)
+					{
+						set_dropping(false);
+					}
+					else if (now >= drop_next_)
+					{
+						++count_;
+						drop_next_ = control_law(drop_next_);
+						return act(item);
+					}
+				}
+				else if (above)
+				{
+					// Resume near the previous drop rate if we only just left it.
+					count_ = count_ > 2 && now - drop_next_ < 16 * interval_ ? count_ - 2 : 1;
+					drop_next_ = control_law(now);
+					set_dropping(true);
+					return act(item);
+				}
+				return true;
+			}
+
+			// An empty queue has no standing delay: leave the dropping state.
+			void idle() noexcept
+			{
+				first_above_ = 0;
+				if (dropping_)
+				{
+					set_dropping(false);
+				}
+			}
+
+			bool dropping() const noexcept
+			{
+				return dropping_;
+			}
+
+			std::uint64_t dropped() const noexcept
+			{
+				return dropped_;
+			}
+
+			std::uint64_t marked() const noexcept
+			{
+				return marked_;
+			}
+
+		private:
+			bool over_target(std::uint64_t sojourn, std::uint64_t now) noexcept
+			{
+				if (sojourn < target_)
+				{
+					first_above_ = 0;
+					return false;
+				}
+				if (first_above_ == 0)
+				{
+					first_above_ = now + interval_;
+					return false;
+				}
+				return now >= first_above_;
+			}
+
+			std::uint64_t control_law(std::uint64_t t) const noexcept
+			{
+				return t + static_cast<std::uint64_t>(static_cast<double>(interval_) / std::sqrt(static_cast<double>(count_)));
+			}
+
+			template<typename T>
+			bool act(Stamped<T>& item) noexcept
+			{
+				if constexpr (Action == AqmAction::drop)
+				{
+					++dropped_;
+					return false;
+				}
+				else
+				{
+					++marked_;
+					item.marked = true;
+					return true;
+				}
+			}
+
+			void set_dropping(bool dropping) noexcept
+			{
+				dropping_ = dropping;
+				if (signal_)
+				{
+					signal_->shedding.store(dropping, detail::mo_relaxed);
+				}
+			}
+
+			std::uint64_t target_;
+			std::uint64_t interval_;
+			ShedSignal* signal_;
+			std::uint64_t first_above_ = 0;
+			std::uint64_t drop_next_ = 0;
+			std::uint64_t count_ = 0;
+			std::uint64_t dropped_ = 0;
+			std::uint64_t marked_ = 0;
+			bool dropping_ = false;
+		};
+
+
+
+		namespace detail
+		{
+
+			// The sample the calling thread's LatencyTracer::Sampler claimed for
+			// the push in progress; taken by the Traced value built by that push.
+			// Only set between the Sampler's admit() and its commit() or abort().
+			inline thread_local std::uint64_t pending_sample = 0;
+
+			// Small per-thread number naming producer tracks in traces.
+			inline std::uint32_t trace_thread_id() noexcept
+			{
+				static std::atomic<std::uint32_t> next{ 1 };
+				thread_local std::uint32_t id = next.fetch_add(1, mo_relaxed);
+				return id;
+			}
+
+		}
+
+		// Value wrapper for LatencyTracer. sample names the tracer slot when the
+		// push was sampled, 0 otherwise; it is picked up from the Sampler stage
+		// when the queue constructs the value in place, so push with
+		// produser.emplace(args...); push(Traced<T>(...)) is never sampled.
+		template<typename T>
+		struct Traced
+		{
+			std::uint64_t sample = 0;
+			T value{};
+
+			Traced() = default;
+
+			template<typename... Args>
+			explicit Traced(std::in_place_t, Args&&... args)
+				: sample(std::exchange(detail::pending_sample, 0)), value(std::forward<Args>(args)...)
+			{
+			}
+
+			template<typename U>
+				requires std::is_constructible_v<T, U&&> && (!std::is_same_v<std::remove_cvref_t<U>, Traced>)
+			explicit Traced(U&& value)
+				: sample(std::exchange(detail::pending_sample, 0)), value(std::forward<U>(value))
+			{
+			}
+		};
+
+		// One sampled message's timeline in tsc() ticks: push started (first
+		// attempt, so time spent on a full queue counts), push committed,
+		// popped by the consumer, handler done. Tells apart contention (start to
+		// commit), queueing (commit to visible) and the handler.
+		struct LatencySample
+		{
+			std::uint64_t push_start;
+			std::uint64_t push_commit;
+			std::uint64_t visible;
+			std::uint64_t handled;
+			std::uint32_t producer;
+		};
+
+		// Records a LatencySample for one push in every `every` per producer
+		// into a lock-free ring of the last `capacity` samples. Unsampled pushes
+		// cost a counter increment in the producer; the consumer side checks
+		// one field. Wire it up as a Produser stage, a Consumer AQM and a call
+		// after the handler:
+		//
+		//   LatencyTracer tracer(4096, 1000);
+		//   queue<Traced<Msg>> q;
+		//   auto produser = q.produser(tracer.sampler());
+		//   auto consumer = q.consumer(tracer.visibility());
+		//   produser.emplace(msg);
+		//   consumer.pop(item); handle(item.value); tracer.handled(item);
+		//   write(tracer.chrome_trace());
+		//
+		// A slot is reused only once its sample completed, so every sampled
+		// value popped must reach handled(); until then pushes that would claim
+		// its slot go unsampled.
+		class LatencyTracer
+		{
+			struct Slot
+			{
+				// The sample (claim index + 1) once every stamp is in, else 0.
+				std::atomic<std::uint64_t> complete{ 0 };
+				std::atomic<std::uint64_t> times[4] = {};
+				std::atomic<std::uint32_t> producer{ 0 };
+				// The sample being recorded, shifted left by one, plus 1 once the
+				// first finish() is in; 0 while no sample is in flight.
+				std::atomic<std::uint64_t> flight{ 0 };
+			};
+
+		public:
+
+			// Produser stage. Put it last so a push rejected by an earlier stage
+			// is never sampled.
+			class Sampler
+			{
+			public:
+				explicit Sampler(LatencyTracer& tracer) noexcept
+					: tracer_(&tracer)
+				{
+				}
+
+				// Every every-th successful push is sampled. A sampled push that
+				// fails (full queue) keeps its sample and start time for the retry.
+				bool admit() noexcept
+				{
+					if (sample_ == 0 && count_ + 1 >= tracer_->every_)
+					{
+						sample_ = tracer_->claim();
+					}
+					detail::pending_sample = sample_;
+					return true;
+				}
+
+				void abort() noexcept
+				{
+					detail::pending_sample = 0;
+				}
+
+				void commit() noexcept
+				{
+					// Still pending: the value was built before the push and does
+					// not carry the sample, so nobody would finish it.
+					bool carried = detail::pending_sample == 0;
+					detail::pending_sample = 0;
+					if (sample_ == 0)
+					{
+						++count_;
+						return;
+					}
+					if (!carried)
+					{
+						tracer_->abandon(sample_);
+						sample_ = 0;
+						count_ = 0;
+						return;
+					}
+					tracer_->stamp(sample_, 1);
+					tracer_->finish(sample_);
+					sample_ = 0;
+					count_ = 0;
+				}
+
+			private:
+				LatencyTracer* tracer_;
+				std::uint64_t sample_ = 0;
+				std::uint32_t count_ = 0;
+			};
+
+			// Consumer AQM that stamps the moment a value is popped.
+			class Visibility
+			{
+			public:
+				explicit Visibility(LatencyTracer& tracer) noexcept
+					: tracer_(&tracer)
+				{
+				}
+
+				template<typename T>
+				bool deliver(Traced<T>& item) noexcept
+				{
+					if (item.sample != 0)
+					{
+						tracer_->stamp(item.sample, 2);
+					}
+					return true;
+				}
+
+				void idle() noexcept
+				{
+				}
+
+			private:
+				LatencyTracer* tracer_;
+			};
+
+			explicit LatencyTracer(std::size_t capacity = 4096, std::uint32_t every = 1024)
+				: mask_(std::bit_ceil(capacity < 2 ? std::size_t(2) : capacity) - 1),
+				  slots_(new Slot[mask_ + 1]),
+				  every_(every == 0 ? 1 : every)
+			{
+			}
+
+			Sampler sampler() noexcept
+			{
+				return Sampler(*this);
+			}
+
+			Visibility visibility() noexcept
+			{
+				return Visibility(*this);
+			}
+
+			// Consumer, after the handler finished with item.
+			template<typename T>
+			void handled(const Traced<T>& item) noexcept
+			{
+				if (item.sample != 0)
+				{
+					stamp(item.sample, 3);
+					finish(item.sample);
+				}
+			}
+
+			// Any thread. Calls f(const LatencySample&) for every complete sample
+			// still in the ring and returns how many there were. Samples being
+			// overwritten during the walk are skipped.
+			template<typename F>
+			std::size_t for_each(F&& f) const
+			{
+				std::size_t count = 0;
+				for (std::size_t i = 0; i <= mask_; ++i)
+				{
+					const Slot& slot = slots_[i];
+					std::uint64_t first = slot.complete.load(detail::mo_acquire);
+					if (first == 0)
+					{
+						continue;
+					}
+					LatencySample sample{
+						slot.times[0].load(detail::mo_relaxed),
+						slot.times[1].load(detail::mo_relaxed),
+						slot.times[2].load(detail::mo_relaxed),
+						slot.times[3].load(detail::mo_relaxed),
+						slot.producer.load(detail::mo_relaxed) };
+					// Seqlock check: claim() clears complete before restamping.
+					std::atomic_thread_fence(detail::mo_acquire);
+					if (slot.complete.load(detail::mo_relaxed) == first)
+					{
+						f(sample);
+						++count;
+					}
+				}
+				return count;
+			}
+
+			// The complete samples in Chrome trace event format (chrome://tracing,
+			// Perfetto): a push span on each producer's track, the time spent
+			// queued as an async span, and the handler on the consumer's track.
+			std::string chrome_trace() const
+			{
+				std::uint64_t origin = UINT64_MAX;
+				for_each([&](const LatencySample& sample) { origin = std::min(origin, sample.push_start); });
+				double us_per_tick = 1e6 / static_cast<double>(detail::tsc_hz());
+				auto us = [&](std::uint64_t ticks) { return std::to_string(static_cast<double>(ticks - origin) * us_per_tick); };
+				auto span = [&](std::uint64_t from, std::uint64_t to) { return std::to_string(static_cast<double>(to > from ? to - from : 0) * us_per_tick); };
+
+				std::string json = "{\"traceEvents\":[\n"
+					"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"consumer\"}}";
+				std::uint64_t id = 0;
+				for_each([&](const LatencySample& sample)
+				{
+					std::string tid = std::to_string(sample.producer);
+					std::string args = ",\"args\":{\"sample\":" + std::to_string(++id) + "}}";
+					json += ",\n{\"name\":\"push\",\"ph\":\"X\",\"pid\":1,\"tid\":" + tid + ",\"ts\":" + us(sample.push_start)
+						+ ",\"dur\":" + span(sample.push_start, sample.push_commit) + args;
+					json += ",\n{\"name\":\"queued\",\"cat\":\"queue\",\"ph\":\"b\",\"id\":" + std::to_string(id)
+						+ ",\"pid\":1,\"tid\":0,\"ts\":" + us(sample.push_commit) + args;
+					json += ",\n{\"name\":\"queued\",\"cat\":\"queue\",\"ph\":\"e\",\"id\":" + std::to_string(id)
+						+ ",\"pid\":1,\"tid\":0,\"ts\":" + us(std::max(sample.push_commit, sample.visible)) + args;
+					json += ",\n{\"name\":\"handle\",\"ph\":\"X\",\"pid\":1,\"tid\":0,\"ts\":" + us(sample.visible)
+						+ ",\"dur\":" + span(sample.visible, sample.handled) + args;
+				});
+				return json + "\n]}\n";
+			}
+
+		private:
+
+			// Producer. Claims the next slot and stamps the push start. Returns 0,
+			// leaving the push unsampled, while the slot's previous sample is
+			// still in flight: restamping it would mix two messages' times.
+			std::uint64_t claim() noexcept
+			{
+				std::uint64_t sample = next_.fetch_add(1, detail::mo_relaxed) + 1;
+				Slot& slot = slots_[(sample - 1) & mask_];
+				std::uint64_t idle = 0;
+				if (!slot.flight.compare_exchange_strong(idle, sample << 1, detail::mo_acquire, detail::mo_relaxed))
+				{
+					return 0;
+				}
+				slot.complete.store(0, detail::mo_relaxed);
+				std::atomic_thread_fence(detail::mo_release);
+				slot.producer.store(detail::trace_thread_id(), detail::mo_relaxed);
+				slot.times[0].store(detail::tsc(), detail::mo_relaxed);
+				return sample;
+			}
+
+			void stamp(std::uint64_t sample, int which) noexcept
+			{
+				slots_[(sample - 1) & mask_].times[which].store(detail::tsc(), detail::mo_relaxed);
+			}
+
+			// Called once by the producer after commit and once by the consumer
+			// after the handler; the second publishes the sample and frees the
+			// slot for the next claim.
+			void finish(std::uint64_t sample) noexcept
+			{
+				Slot& slot = slots_[(sample - 1) & mask_];
+				if (slot.flight.fetch_add(1, detail::mo_acq_rel) & 1)
+				{
+					slot.complete.store(sample, detail::mo_release);
+					slot.flight.store(0, detail::mo_release);
+				}
+			}
+
+			// Frees the slot of a sample that will never complete.
+			void abandon(std::uint64_t sample) noexcept
+			{
+				slots_[(sample - 1) & mask_].flight.store(0, detail::mo_release);
+			}
+
+			std::size_t mask_;
+			std::unique_ptr<Slot[]> slots_;
+			std::uint32_t every_;
+			alignas(detail::cache_line) std::atomic<std::uint64_t> next_{ 0 };
+		};
+
+
+
+		template<typename Queue, typename Aqm = NoAqm>
+		class Consumer
+		{
+		public:
+			using value_type = typename Queue::value_type;
+
+			explicit Consumer(Queue& queue) noexcept
+				: queue_(&queue)
+			{
+			}
+
+			Consumer(Queue& queue, Aqm aqm) noexcept
+				: queue_(&queue), aqm_(std::move(aqm))
+			{
+			}
+
+			~Consumer()
+			{
+			}
+
+			bool pop(value_type& out)
+			{
+				while (queue_->try_pop(out))
+				{
+					known_ -= known_ != 0;
+					if (aqm_.deliver(out))
+					{
+						return true;
+					}
+				}
+				aqm_.idle();
+				return false;
+			}
+
+			// Blocks through the queue's wait strategy until a value is delivered.
+			void wait_pop(value_type& out) requires requires(Queue& queue) { queue.wait_readable(); }
+			{
+				while (!pop(out))
+				{
+					queue_->wait_readable();
+				}
+			}
+
+			// Pops up to max values into f and returns how many were handled.
+			template<typename F>
+			std::size_t drain(F&& f, std::size_t max = SIZE_MAX)
+			{
+				std::size_t count = 0;
+				value_type value;
+				while (count < max && pop(value))
+				{
+					f(std::move(value));
+					++count;
+				}
+				return count;
+			}
+
+			// In-place access for ring queues: up to two spans over ring memory
+			// holding the committed values at the head, at most max in total, the
+			// second non-empty only when they wrap. Values stay queued until
+			// advance(n) consumes the first n. Bypasses the AQM, so only available
+			// without one.
+			std::array<std::span<value_type>, 2> readable_spans(std::size_t max = SIZE_MAX) noexcept
+				requires std::is_same_v<Aqm, NoAqm> && requires(Queue& queue) { queue.readable_spans(max, max); }
+			{
+				auto spans = queue_->readable_spans(max, known_ < max ? known_ : max);
+				known_ = spans[0].size() + spans[1].size();
+				return spans;
+			}
+
+			void advance(std::size_t count) noexcept
+				requires std::is_same_v<Aqm, NoAqm> && requires(Queue& queue) { queue.advance(count); }
+			{
+				queue_->advance(count);
+				known_ = count < known_ ? known_ - count : 0;
+			}
+
+			Aqm& aqm() noexcept
+			{
+				return aqm_;
+			}
+
+		private:
+			Queue* queue_;
+			Aqm aqm_;
+			// Values readable_spans() already saw committed; they need no recheck.
+			std::size_t known_ = 0;
+		};
+
+
+
+		// Compile-time queue builder. queue<T, Policies...> picks at most one
+		// policy per category (engine, wait, overflow, stats, alloc) and falls
+		// back to a default for the rest; every choice is a type, so the hot path
+		// contains only the code the combination needs.
+
+		namespace detail
+		{
+
+			struct engine_tag
+			{
+			};
+
+			struct wait_tag
+			{
+			};
+
+			struct overflow_tag
+			{
+			};
+
+			struct stats_tag
+			{
+			};
+
+			struct alloc_tag
+			{
+			};
+
+			template<typename Tag, typename Default, typename... Policies>
+			struct select
+			{
+				using type = Default;
+			};
+
+			template<typename Tag, typename Default, typename Policy, typename... Rest>
+			struct select<Tag, Default, Policy, Rest...>
+			{
+				using type = std::conditional_t<std::is_same_v<typename Policy::category, Tag>,
+					Policy, typename select<Tag, Default, Rest...>::type>;
+			};
+
+			template<typename Tag, typename... Policies>
+			inline constexpr std::size_t count_category = (std::size_t(0) + ... + std::size_t(std::is_same_v<typename Policies::category, Tag>));
+
+			template<typename Policy>
+			inline constexpr bool known_category = std::is_same_v<typename Policy::category, engine_tag>
+				|| std::is_same_v<typename Policy::category, wait_tag>
+				|| std::is_same_v<typename Policy::category, overflow_tag>
+				|| std::is_same_v<typename Policy::category, stats_tag>
+				|| std::is_same_v<typename Policy::category, alloc_tag>;
+
+		}
+
+		namespace engine
+		{
+
+			template<typename Reclaim = ImmediateReclaim>
+			struct linked
+			{
+				using category = detail::engine_tag;
+
+				template<typename T, typename Allocator>
+				using type = LinkedEngine<T, Reclaim, Allocator>;
+			};
+
+			struct ring
+			{
+				using category = detail::engine_tag;
+
+				template<typename T, typename Allocator>
+				using type = RingEngine<T, Allocator>;
+			};
+
+		}
+
+		// Wait strategies decide how the consumer waits for data (wait) and how a
+		// producer backs off while a bounded engine is full (relax). notify runs
+		// after every successful push. wait gets the engine's watch() so spinning
+		// can sleep on the cache line the next push writes (wfe on ARM64).
+		namespace wait
+		{
+
+			struct spin
+			{
+				using category = detail::wait_tag;
+
+				template<typename Ready, typename Watch, typename Stats>
+				void wait(Ready&& ready, Watch&& watch, Stats&) noexcept
+				{
+					while (!ready())
+					{
+						detail::wait_on(watch());
+					}
+				}
+
+				void notify() noexcept
+				{
+				}
+
+				void relax(unsigned&) noexcept
+				{
+					detail::cpu_relax();
+				}
+			};
+
+			struct yield
+			{
+				using category = detail::wait_tag;
+
+				template<typename Ready, typename Watch, typename Stats>
+				void wait(Ready&& ready, Watch&&, Stats&) noexcept
+				{
+					while (!ready())
+					{
+						std::this_thread::yield();
+					}
+				}
+
+				void notify() noexcept
+				{
+				}
+
+				void relax(unsigned&) noexcept
+				{
+					std::this_thread::yield();
+				}
+			};
+
+			// Sleeps on the engine's watch() line with umonitor/umwait, so an idle
+			// consumer stops burning its core yet wakes on the producer's store
+			// rather than a futex syscall. Each sleep is bounded by TimeoutCycles.
+			// The kernel is chosen at run time and falls back to pause (or wfe)
+			// when CPUID lacks WAITPKG.
+			template<std::uint64_t TimeoutCycles = 100000>
+			struct umwait
+			{
+				using category = detail::wait_tag;
+
+				template<typename Ready, typename Watch, typename Stats>
+				void wait(Ready&& ready, Watch&& watch, Stats&) noexcept
+				{
+					const detail::Kernels& kernels = detail::kernels();
+					while (!ready())
+					{
+						kernels.wait(watch(), detail::tsc() + TimeoutCycles);
+					}
+				}
+
+				void notify() noexcept
+				{
+				}
+
+				void relax(unsigned&) noexcept
+				{
+					detail::cpu_relax();
+				}
+			};
+
+			// Spins for Spins rounds, then sleeps on a futex (std::atomic::wait).
+			// Producers pay a full fence and a load of a mostly-clean line per push
+			// and only touch the futex word while the consumer is asleep.
+			template<unsigned Spins = 256>
+			struct park
+			{
+				using category = detail::wait_tag;
+
+				template<typename Ready, typename Watch, typename Stats>
+				void wait(Ready&& ready, Watch&& watch, Stats& stats) noexcept
+				{
+					for (unsigned i = 0; i < Spins; ++i)
+					{
+						if (ready())
+						{
+							return;
+						}
+						detail::wait_on(watch());
+					}
+					for (;;)
+					{
+						// The futex word is only a wake-up key; data is synchronised
+						// by ready() against the engine, so it stays relaxed.
+						std::uint32_t key = futex_.load(detail::mo_relaxed);
+						sleeping_.store(true, detail::mo_relaxed);
+						// Pairs with the fence in notify() (store-load on both
+						// sides). ThreadSanitizer ignores fences, so it cannot
+						// check this handshake; a lost wake-up shows up as a hang
+						// in the park stress runs instead.
+						std::atomic_thread_fence(detail::mo_seq_cst);
+						if (ready())
+						{
+							sleeping_.store(false, detail::mo_relaxed);
+							return;
+						}
+						GREEZEZ_MPSC_STRESS_POINT();
+						stats.on_park();
+						GREEZEZ_MPSC_PROBE(park, this, key, 0);
+						futex_.wait(key, detail::mo_relaxed);
+						sleeping_.store(false, detail::mo_relaxed);
+						GREEZEZ_MPSC_PROBE(wake, this, key, 0);
+						stats.on_wake();
+						if (ready())
+						{
+							return;
+						}
+					}
+				}
+
+				void notify() noexcept
+				{
+					std::atomic_thread_fence(detail::mo_seq_cst);
+					if (sleeping_.load(detail::mo_relaxed))
+					{
+						futex_.fetch_add(1, detail::mo_relaxed);
+						futex_.notify_one();
+					}
+				}
+
+				void relax(unsigned& round) noexcept
+				{
+					if (++round < Spins)
+					{
+						detail::cpu_relax();
+					}
+					else
+					{
+						std::this_thread::yield();
+					}
+				}
+
+			private:
+				alignas(detail::cache_line) std::atomic<std::uint32_t> futex_{ 0 };
+				std::atomic<bool> sleeping_{ false };
+			};
+
+		}
+
+		namespace overflow
+		{
+
+			// Pushes into a full engine return false.
+			struct fail
+			{
+				using category = detail::overflow_tag;
+			};
+
+			// Pushes into a full engine back off through the wait strategy until
+			// the consumer frees a slot.
+			struct block
+			{
+				using category = detail::overflow_tag;
+			};
+
+		}
+
+		namespace stats
+		{
+
+			struct none
+			{
+				using category = detail::stats_tag;
+
+				void on_pop(std::size_t = 1) noexcept
+				{
+				}
+
+				void on_full() noexcept
+				{
+				}
+
+				void on_park() noexcept
+				{
+				}
+
+				void on_wake() noexcept
+				{
+				}
+			};
+
+			// Counts consumer-side events on a consumer-owned line and full events
+			// on the producers' slow path; successful pushes are not counted since
+			// that would put a shared write on every push.
+			struct counters
+			{
+				using category = detail::stats_tag;
+
+				struct Snapshot
+				{
+					std::uint64_t popped;
+					std::uint64_t full;
+					std::uint64_t parks;
+					std::uint64_t wakeups;
+				};
+
+				void on_pop(std::size_t count = 1) noexcept
+				{
+					bump(popped_, count);
+				}
+
+				void on_full() noexcept
+				{
+					full_.fetch_add(1, detail::mo_relaxed);
+				}
+
+				void on_park() noexcept
+				{
+					bump(parks_);
+				}
+
+				void on_wake() noexcept
+				{
+					bump(wakeups_);
+				}
+
+				Snapshot snapshot() const noexcept
+				{
+					return { popped_.load(detail::mo_relaxed), full_.load(detail::mo_relaxed),
+						parks_.load(detail::mo_relaxed), wakeups_.load(detail::mo_relaxed) };
+				}
+
+			private:
+				// Single writer: a plain increment, readable from other threads.
+				static void bump(std::atomic<std::uint64_t>& counter, std::size_t count = 1) noexcept
+				{
+					counter.store(counter.load(detail::mo_relaxed) + count, detail::mo_relaxed);
+				}
+
+				alignas(detail::cache_line) std::atomic<std::uint64_t> popped_{ 0 };
+				std::atomic<std::uint64_t> parks_{ 0 };
+				std::atomic<std::uint64_t> wakeups_{ 0 };
+				alignas(detail::cache_line) std::atomic<std::uint64_t> full_{ 0 };
+			};
+
+		}
+
+		// Allocator for every engine allocation (ring storage, nodes); engines
+		// rebind it as needed. The queue constructor forwards a trailing
+		// allocator, or anything it converts from such as a memory_resource*.
+		template<typename Allocator>
+		struct alloc
+		{
+			using category = detail::alloc_tag;
+			using type = Allocator;
+		};
+
+		using pmr_alloc = alloc<std::pmr::polymorphic_allocator<std::byte>>;
+
+
+
+		template<typename T, typename... Policies>
+		class queue
+		{
+			static_assert((detail::known_category<Policies> && ...), "unknown queue policy");
+			static_assert(detail::count_category<detail::engine_tag, Policies...> <= 1, "more than one engine policy");
+			static_assert(detail::count_category<detail::wait_tag, Policies...> <= 1, "more than one wait policy");
+			static_assert(detail::count_category<detail::overflow_tag, Policies...> <= 1, "more than one overflow policy");
+			static_assert(detail::count_category<detail::stats_tag, Policies...> <= 1, "more than one stats policy");
+			static_assert(detail::count_category<detail::alloc_tag, Policies...> <= 1, "more than one alloc policy");
+
+			using engine_policy = typename detail::select<detail::engine_tag, engine::linked<>, Policies...>::type;
+			using wait_policy = typename detail::select<detail::wait_tag, wait::spin, Policies...>::type;
+			using overflow_policy = typename detail::select<detail::overflow_tag, overflow::fail, Policies...>::type;
+			using stats_policy = typename detail::select<detail::stats_tag, stats::none, Policies...>::type;
+			using alloc_policy = typename detail::select<detail::alloc_tag, alloc<std::allocator<T>>, Policies...>::type;
+
+		public:
+			using value_type = T;
+			using allocator_type = typename alloc_policy::type;
+			using engine_type = typename engine_policy::template type<T, allocator_type>;
+			using stats_type = stats_policy;
+
+			// Arguments are forwarded to the engine, e.g. the ring capacity.
+			template<typename... Args>
+			explicit queue(Args&&... args)
+				: engine_(std::forward<Args>(args)...)
+			{
+			}
+
+			queue(const queue&) = delete;
+			queue& operator=(const queue&) = delete;
+
+			template<typename... Stages>
+			Produser<queue, Stages...> produser(Stages... stages)
+			{
+				if constexpr (sizeof...(Stages) == 0)
+				{
+					return Produser<queue>(*this);
+				}
+				else
+				{
+					return Produser<queue, Stages...>(*this, std::move(stages)...);
+				}
+			}
+
+			template<typename Aqm = NoAqm>
+			Consumer<queue, Aqm> consumer(Aqm aqm = Aqm())
+			{
+				return Consumer<queue, Aqm>(*this, std::move(aqm));
+			}
+
+			// Engines construct the value only once a slot is claimed, so retrying
+			// with the same arguments after a full engine is safe.
+			template<typename... Args>
+			bool try_emplace(Args&&... args)
+			{
+				if constexpr (std::is_same_v<overflow_policy, overflow::block>)
+				{
+					unsigned round = 0;
+					while (!engine_.try_emplace(std::forward<Args>(args)...))
+					{
+						stats_.on_full();
+						wait_.relax(round);
+					}
+				}
+				else if (!engine_.try_emplace(std::forward<Args>(args)...))
+				{
+					stats_.on_full();
+					return false;
+				}
+				wait_.notify();
+				return true;
+			}
+
+			// Consumer only.
+			bool try_pop(T& out)
+			{
+				if (!engine_.try_pop(out))
+				{
+					return false;
+				}
+				stats_.on_pop();
+				return true;
+			}
+
+			// Consumer only, for engines with in-place access (RingEngine).
+			std::array<std::span<T>, 2> readable_spans(std::size_t max = SIZE_MAX, std::size_t known = 0) noexcept
+				requires requires(engine_type& engine) { engine.readable_spans(max, known); }
+			{
+				return engine_.readable_spans(max, known);
+			}
+
+			void advance(std::size_t count) noexcept
+				requires requires(engine_type& engine) { engine.advance(count); }
+			{
+				engine_.advance(count);
+				stats_.on_pop(count);
+			}
+
+			// Consumer only. Returns once the engine has a value to pop.
+			void wait_readable()
+			{
+				wait_.wait([this] { return !engine_.empty(); }, [this] { return engine_.watch(); }, stats_);
+			}
+
+			// Storage needed to build the queue over caller-provided memory.
+			static constexpr std::size_t required_bytes(std::size_t capacity) noexcept
+				requires requires { engine_type::required_bytes(capacity); }
+			{
+				return engine_type::required_bytes(capacity);
+			}
+
+			engine_type& engine() noexcept
+			{
+				return engine_;
+			}
+
+			const stats_type& stats() const noexcept
+			{
+				return stats_;
+			}
+
+		private:
+			engine_type engine_;
+			[[no_unique_address]] wait_policy wait_;
+			[[no_unique_address]] stats_policy stats_;
+		};
+
+
+		namespace detail
+		{
+			// Gathering and delivery shared by the batching consumers. collect()
+			// looks at up to Max ready values and asks decide(ready, waited) whether
+			// to hand them to f now; waited is the ticks since the oldest of them
+			// was first seen. On queues with in-place access the span points
+			// straight into the ring unless the batch wraps, in which case it is
+			// moved into a scratch buffer; other queues always go through the
+			// scratch buffer. Values left in the span after f returns are destroyed.
+			template<typename Queue, std::size_t Max>
+			class BatchCollector
+			{
+				static_assert(Max > 0, "batch size must be non-zero");
+
+				static constexpr bool in_place = requires(Queue& queue, std::size_t count) {
+					queue.readable_spans(count, count);
+					queue.advance(count);
+				};
+
+			public:
+				using value_type = typename Queue::value_type;
+
+				explicit BatchCollector(Queue& queue)
+					: queue_(&queue)
+				{
+					scratch_.reserve(Max);
+				}
+
+				Queue& queue() const noexcept
+				{
+					return *queue_;
+				}
+
+				// Values seen but not yet delivered.
+				std::size_t pending() const noexcept
+				{
+					return seen_;
+				}
+
+				template<typename F, typename Decide>
+				std::size_t collect(F& f, Decide&& decide)
+				{
+					std::size_t ready;
+					std::array<std::span<value_type>, 2> spans;
+					if constexpr (in_place)
+					{
+						spans = queue_->readable_spans(Max, seen_);
+						ready = spans[0].size() + spans[1].size();
+					}
+					else
+					{
+						value_type value;
+						while (scratch_.size() < Max && queue_->try_pop(value))
+						{
+							scratch_.push_back(std::move(value));
+						}
+						ready = scratch_.size();
+					}
+
+					if (ready == 0)
+					{
+						return 0;
+					}
+					std::uint64_t now = tsc();
+					if (seen_ == 0)
+					{
+						first_seen_ = now;
+					}
+					seen_ = ready;
+					if (!decide(ready, now - first_seen_))
+					{
+						return 0;
+					}
+
+					if constexpr (in_place)
+					{
+						if (spans[1].empty())
+						{
+							f(spans[0]);
+						}
+						else
+						{
+							for (auto& span : spans)
+							{
+								std::move(span.begin(), span.end(), std::back_inserter(scratch_));
+							}
+							f(std::span<value_type>(scratch_));
+							scratch_.clear();
+						}
+						queue_->advance(ready);
+					}
+					else
+					{
+						f(std::span<value_type>(scratch_));
+						scratch_.clear();
+					}
+					seen_ = 0;
+					return ready;
+				}
+
+			private:
+				Queue* queue_;
+				std::uint64_t first_seen_ = 0;
+				std::size_t seen_ = 0;
+				std::vector<value_type> scratch_;
+			};
+		}
+
+
+		// Consumer adaptor delivering values in batches: f(std::span<T>) runs once
+		// N values are ready or max_delay has passed since the oldest undelivered
+		// value was first seen, whichever comes first. The span points into the
+		// ring where it can (see detail::BatchCollector).
+		template<typename Queue, std::size_t N>
+		class BatchingConsumer
+		{
+			static_assert(N > 0, "BatchingConsumer batch size must be non-zero");
+
+		public:
+			using value_type = typename Queue::value_type;
+
+			BatchingConsumer(Queue& queue, std::chrono::nanoseconds max_delay)
+				: collector_(queue),
+				  delay_(detail::to_ticks(max_delay))
+			{
+			}
+
+			// Non-blocking. Delivers at most one batch and returns its size.
+			template<typename F>
+			std::size_t poll(F&& f)
+			{
+				return collector_.collect(f, [this](std::size_t ready, std::uint64_t waited) { return ready >= N || waited >= delay_; });
+			}
+
+			// Delivers whatever is ready now, ignoring the batch size and deadline.
+			template<typename F>
+			std::size_t flush(F&& f)
+			{
+				return collector_.collect(f, [](std::size_t, std::uint64_t) { return true; });
+			}
+
+		private:
+			detail::BatchCollector<Queue, N> collector_;
+			std::uint64_t delay_;
+		};
+
+
+		// Batching consumer that tunes itself to the load. The batch target
+		// follows the backlog found when a batch starts (averaged, and halved
+		// each time the queue is found empty), capped by the values expected to
+		// arrive within max_delay at the rate seen over ~1 ms windows, between 1
+		// and MaxBatch. A consumer that keeps up finds one value at a time and
+		// delivers it at once; one falling behind finds a backlog and waits for
+		// batches of that size, which fill before max_delay. wait_poll()
+		// spins for a budget of a few expected inter-arrival gaps, capped at
+		// max_spin, before blocking in the queue's wait strategy; when arrivals
+		// are further apart than max_spin it blocks right away.
+		template<typename Queue, std::size_t MaxBatch = 256>
+		class AdaptiveBatchingConsumer
+		{
+		public:
+			using value_type = typename Queue::value_type;
+
+			AdaptiveBatchingConsumer(Queue& queue, std::chrono::nanoseconds max_delay,
+				std::chrono::nanoseconds max_spin = std::chrono::microseconds(50))
+				: collector_(queue),
+				  delay_(detail::to_ticks(max_delay)),
+				  max_spin_(detail::to_ticks(max_spin)),
+				  window_(std::max<std::uint64_t>(detail::to_ticks(std::chrono::milliseconds(1)), 1)),
+				  window_start_(detail::tsc())
+			{
+			}
+
+			// Non-blocking. Delivers at most one batch and returns its size.
+			template<typename F>
+			std::size_t poll(F&& f)
+			{
+				std::size_t before = collector_.pending();
+				std::size_t delivered = collector_.collect(f, [&](std::size_t ready, std::uint64_t waited)
+				{
+					arrivals_ += ready - before;
+					if (before == 0)
+					{
+						depth_ += (static_cast<double>(ready) - depth_) / 4;
+					}
+					return ready >= target_ || waited >= delay_;
+				});
+				if (delivered == 0 && collector_.pending() == 0)
+				{
+					depth_ /= 2;
+				}
+				retune(detail::tsc());
+				return delivered;
+			}
+
+			// Blocks until a batch has been delivered and returns its size. While
+			// a partial batch waits for its deadline the consumer spins instead.
+			template<typename F>
+			std::size_t wait_poll(F&& f) requires requires(Queue& queue) { queue.wait_readable(); }
+			{
+				std::uint64_t idle_since = detail::tsc();
+				for (;;)
+				{
+					if (std::size_t delivered = poll(f))
+					{
+						return delivered;
+					}
+					if (collector_.pending() == 0 && detail::tsc() - idle_since >= spin_)
+					{
+						collector_.queue().wait_readable();
+						idle_since = detail::tsc();
+					}
+					else
+					{
+						detail::cpu_relax();
+					}
+				}
+			}
+
+			// Delivers whatever is ready now, ignoring the batch target and deadline.
+			template<typename F>
+			std::size_t flush(F&& f)
+			{
+				std::size_t before = collector_.pending();
+				std::size_t delivered = collector_.collect(f, [&](std::size_t ready, std::uint64_t)
+				{
+					arrivals_ += ready - before;
+					return true;
+				});
+				retune(detail::tsc());
+				return delivered;
+			}
+
+			// Values the next batch waits for, in [1, MaxBatch].
+			std::size_t batch_size() const noexcept
+			{
+				return target_;
+			}
+
+			std::chrono::nanoseconds spin_budget() const noexcept
+			{
+				return std::chrono::nanoseconds(static_cast<std::int64_t>(static_cast<double>(spin_) * 1e9 / static_cast<double>(detail::tsc_hz())));
+			}
+
+			// Smoothed arrivals per second.
+			double arrival_rate() const noexcept
+			{
+				return rate_ * static_cast<double>(detail::tsc_hz());
+			}
+
+		private:
+			void retune(std::uint64_t now) noexcept
+			{
+				double wanted = std::min(depth_, rate_ * static_cast<double>(delay_));
+				target_ = static_cast<std::size_t>(std::clamp(wanted, 1.0, static_cast<double>(MaxBatch)));
+
+				std::uint64_t elapsed = now - window_start_;
+				if (elapsed < window_)
+				{
+					return;
+				}
+				// Rises smoothly, falls at once: a drop in load should stop the
+				// waiting for batches that no longer fill.
+				double rate = static_cast<double>(arrivals_) / static_cast<double>(elapsed);
+				rate_ = rate < rate_ ? rate : rate_ + (rate - rate_) / 4;
+				arrivals_ = 0;
+				window_start_ = now;
+
+				double gap = rate_ > 0 ? 1 / rate_ : 0;
+				spin_ = rate_ > 0 && gap <= static_cast<double>(max_spin_)
+					? std::min(max_spin_, static_cast<std::uint64_t>(4 * gap))
+					: 0;
+			}
 
+			detail::BatchCollector<Queue, MaxBatch> collector_;
+			std::uint64_t delay_;
+			std::uint64_t max_spin_;
+			std::uint64_t window_;
+			std::uint64_t window_start_;
+			std::uint64_t arrivals_ = 0;
+			double rate_ = 0;   // arrivals per tick
+			double depth_ = 0;  // backlog when a batch starts, averaged
+			std::size_t target_ = 1;
+			std::uint64_t spin_ = 0;
 		};
 
 
@@ -44,4 +3111,4 @@ namespace greezez
 	}
 }
 
-#endif // !GREEZEZ_MPSCQUEUE_HPP
\ No newline at end of file
+#endif // !GREEZEZ_MPSCQUEUE_HPP
@@ -0,0 +1,443 @@
+#pragma once
+#ifndef GREEZEZ_MPSCTOPOLOGY_HPP
+#define GREEZEZ_MPSCTOPOLOGY_HPP
+
+// CPU topology and thread pinning for placing a queue's consumer and
+// producers. Where they sit relative to each other (SMT sibling, shared
+// L2/L3, other socket) decides how far every cache line the queue bounces
+// has to travel, so make that placement explicit.
+
+#include <algorithm>
+#include <cstddef>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace greezez
+{
+	namespace mpsc
+	{
+
+		// One logical CPU. Each group is named by the lowest CPU in it, so two
+		// CPUs share a core, L2, L3 or package exactly when those fields match.
+		struct CpuInfo
+		{
+			unsigned id;
+			unsigned core;
+			unsigned l2;
+			unsigned l3;
+			unsigned package;
+			bool isolated;
+		};
+
+		// How far apart two CPUs are, nearest first: hardware threads of one
+		// core, cores sharing an L3 (one CCX on EPYC, the whole die on most
+		// Intel parts), different L3s in one package, different packages.
+		enum class Distance
+		{
+			same_cpu,
+			smt_sibling,
+			shared_l3,
+			other_l3,
+			other_package
+		};
+
+		inline const char* to_string(Distance distance) noexcept
+		{
+			switch (distance)
+			{
+			case Distance::same_cpu:
+				return "same cpu";
+			case Distance::smt_sibling:
+				return "smt sibling";
+			case Distance::shared_l3:
+				return "shared l3";
+			case Distance::other_l3:
+				return "other l3";
+			default:
+				return "other package";
+			}
+		}
+
+		namespace detail
+		{
+
+			// Parses a sysfs cpu list such as "0-3,8,10-11".
+			inline std::vector<unsigned> parse_cpu_list(const std::string& text)
+			{
+				std::vector<unsigned> cpus;
+				std::size_t at = 0;
+				while (at < text.size())
+				{
+					std::size_t end = text.find(',', at);
+					if (end == std::string::npos)
+					{
+						end = text.size();
+					}
+					std::string item = text.substr(at, end - at);
+					at = end + 1;
+					if (item.empty() || item[0] < '0' || item[0] > '9')
+					{
+						continue;
+					}
+					std::size_t dash = item.find('-');
+					unsigned first = static_cast<unsigned>(std::stoul(item.substr(0, dash)));
+					unsigned last = dash == std::string::npos ? first : static_cast<unsigned>(std::stoul(item.substr(dash + 1)));
+					for (unsigned cpu = first; cpu <= last; ++cpu)
+					{
+						cpus.push_back(cpu);
+					}
+				}
+				return cpus;
+			}
+
+			inline bool read_line(const std::string& path, std::string& out)
+			{
+				std::ifstream file(path);
+				return static_cast<bool>(std::getline(file, out));
+			}
+
+			// Lowest CPU in the list file at path, or fallback if it can't be read.
+			inline unsigned group_of(const std::string& path, unsigned fallback)
+			{
+				std::string line;
+				if (!read_line(path, line))
+				{
+					return fallback;
+				}
+				std::vector<unsigned> cpus = parse_cpu_list(line);
+				return cpus.empty() ? fallback : *std::min_element(cpus.begin(), cpus.end());
+			}
+
+		}
+
+		class Topology
+		{
+		public:
+
+			// Reads /sys/devices/system/cpu (or a copy of it at root). Whatever is
+			// missing (non-Linux, some containers) leaves a CPU in its own core
+			// and cache groups on package 0.
+			static Topology detect(const std::string& root = "/sys/devices/system/cpu/")
+			{
+				Topology topology;
+				std::string line;
+				std::vector<unsigned> online;
+				if (detail::read_line(root + "online", line))
+				{
+					online = detail::parse_cpu_list(line);
+				}
+				if (online.empty())
+				{
+					unsigned count = std::max(1u, std::thread::hardware_concurrency());
+					for (unsigned cpu = 0; cpu < count; ++cpu)
+					{
+						online.push_back(cpu);
+					}
+				}
+				std::vector<unsigned> isolated;
+				if (detail::read_line(root + "isolated", line))
+				{
+					isolated = detail::parse_cpu_list(line);
+				}
+
+				for (unsigned cpu : online)
+				{
+					std::string base = root + "cpu" + std::to_string(cpu) + "/";
+					CpuInfo info{ cpu, cpu, cpu, cpu, 0, false };
+					info.core = detail::group_of(base + "topology/thread_siblings_list", cpu);
+					if (detail::read_line(base + "topology/physical_package_id", line) && !line.empty() && line[0] != '-')
+					{
+						info.package = static_cast<unsigned>(std::stoul(line));
+					}
+					for (unsigned index = 0;; ++index)
+					{
+						std::string cache = base + "cache/index" + std::to_string(index) + "/";
+						if (!detail::read_line(cache + "level", line))
+						{
+							break;
+						}
+						if (line == "2")
+						{
+							info.l2 = detail::group_of(cache + "shared_cpu_list", cpu);
+						}
+						else if (line == "3")
+						{
+							info.l3 = detail::group_of(cache + "shared_cpu_list", cpu);
+						}
+					}
+					info.isolated = std::find(isolated.begin(), isolated.end(), cpu) != isolated.end();
+					topology.cpus_.push_back(info);
+				}
+				return topology;
+			}
+
+			const std::vector<CpuInfo>& cpus() const noexcept
+			{
+				return cpus_;
+			}
+
+			// nullptr if cpu is not online.
+			const CpuInfo* find(unsigned cpu) const noexcept
+			{
+				for (const CpuInfo& info : cpus_)
+				{
+					if (info.id == cpu)
+					{
+						return &info;
+					}
+				}
+				return nullptr;
+			}
+
+			// Two different hardware threads of one core.
+			bool smt_siblings(unsigned a, unsigned b) const noexcept
+			{
+				return a != b && same(a, b, &CpuInfo::core);
+			}
+
+			bool share_l2(unsigned a, unsigned b) const noexcept
+			{
+				return same(a, b, &CpuInfo::l2);
+			}
+
+			bool share_l3(unsigned a, unsigned b) const noexcept
+			{
+				return same(a, b, &CpuInfo::l3);
+			}
+
+			bool same_package(unsigned a, unsigned b) const noexcept
+			{
+				return same(a, b, &CpuInfo::package);
+			}
+
+			Distance distance(unsigned a, unsigned b) const noexcept
+			{
+				if (a == b)
+				{
+					return Distance::same_cpu;
+				}
+				if (smt_siblings(a, b))
+				{
+					return Distance::smt_sibling;
+				}
+				if (share_l3(a, b))
+				{
+					return Distance::shared_l3;
+				}
+				return same_package(a, b) ? Distance::other_l3 : Distance::other_package;
+			}
+
+			// CPUs taken out of the scheduler with isolcpus=.
+			std::vector<unsigned> isolated() const
+			{
+				std::vector<unsigned> result;
+				for (const CpuInfo& info : cpus_)
+				{
+					if (info.isolated)
+					{
+						result.push_back(info.id);
+					}
+				}
+				return result;
+			}
+
+			// One line per CPU: "cpu 3: core 1 l2 1 l3 0 package 0 isolated".
+			std::string describe() const
+			{
+				std::string text;
+				for (const CpuInfo& info : cpus_)
+				{
+					text += "cpu " + std::to_string(info.id)
+						+ ": core " + std::to_string(info.core)
+						+ " l2 " + std::to_string(info.l2)
+						+ " l3 " + std::to_string(info.l3)
+						+ " package " + std::to_string(info.package)
+						+ (info.isolated ? " isolated\n" : "\n");
+				}
+				return text;
+			}
+
+		private:
+
+			bool same(unsigned a, unsigned b, unsigned CpuInfo::*group) const noexcept
+			{
+				const CpuInfo* first = find(a);
+				const CpuInfo* second = find(b);
+				return first && second && first->*group == second->*group;
+			}
+
+			std::vector<CpuInfo> cpus_;
+		};
+
+		// Pins the calling thread to cpu. False when the kernel refuses (offline
+		// CPU, outside this process's cpuset) or pinning isn't supported here.
+		inline bool pin_this_thread(unsigned cpu) noexcept
+		{
+#if defined(__linux__)
+			if (cpu >= CPU_SETSIZE)
+			{
+				return false;
+			}
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(cpu, &set);
+			return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+			(void)cpu;
+			return false;
+#endif
+		}
+
+		// The CPU the calling thread is running on, or -1 if unknown.
+		inline int current_cpu() noexcept
+		{
+#if defined(__linux__)
+			return sched_getcpu();
+#else
+			return -1;
+#endif
+		}
+
+		namespace detail
+		{
+
+			// Reorders cpus so that one hardware thread of each core comes before
+			// any second thread, keeping producers off each other's cores for as
+			// long as there are cores to spare.
+			inline void spread_cores(const Topology& topology, std::vector<unsigned>& cpus)
+			{
+				std::vector<unsigned> cores;
+				std::stable_partition(cpus.begin(), cpus.end(), [&](unsigned cpu)
+				{
+					unsigned core = topology.find(cpu)->core;
+					if (std::find(cores.begin(), cores.end(), core) != cores.end())
+					{
+						return false;
+					}
+					cores.push_back(core);
+					return true;
+				});
+			}
+
+		}
+
+		// Where the consumer and each producer of one queue run.
+		struct Placement
+		{
+			unsigned consumer;
+			std::vector<unsigned> producers;
+
+			// E.g. "consumer 3 (isolated), producers 1 2: 2 share L3, 0 SMT
+			// siblings, 0 cross-package".
+			std::string describe(const Topology& topology) const
+			{
+				const CpuInfo* info = topology.find(consumer);
+				std::string text = "consumer " + std::to_string(consumer) + (info && info->isolated ? " (isolated)" : "") + ", producers";
+				unsigned l3 = 0;
+				unsigned smt = 0;
+				unsigned remote = 0;
+				for (unsigned cpu : producers)
+				{
+					text += ' ';
+					text += std::to_string(cpu);
+					l3 += topology.share_l3(cpu, consumer);
+					smt += topology.smt_siblings(cpu, consumer);
+					remote += !topology.same_package(cpu, consumer);
+				}
+				return text + ": " + std::to_string(l3) + " share L3, " + std::to_string(smt) + " SMT siblings, "
+					+ std::to_string(remote) + " cross-package";
+			}
+		};
+
+		// The default placement: the consumer on an isolated CPU if there is one
+		// (else the last CPU), its SMT siblings left idle, producers first on
+		// CPUs sharing the consumer's L3, then on the rest. Producers wrap
+		// around when there are more of them than CPUs left.
+		inline Placement plan_placement(const Topology& topology, unsigned producers)
+		{
+			const std::vector<CpuInfo>& cpus = topology.cpus();
+			Placement placement{ 0, {} };
+			if (cpus.empty())
+			{
+				placement.producers.assign(producers, 0);
+				return placement;
+			}
+			std::vector<unsigned> isolated = topology.isolated();
+			placement.consumer = isolated.empty() ? cpus.back().id : isolated.front();
+
+			std::vector<unsigned> near;
+			std::vector<unsigned> far;
+			for (const CpuInfo& info : cpus)
+			{
+				if (info.id == placement.consumer || topology.smt_siblings(info.id, placement.consumer))
+				{
+					continue;
+				}
+				(topology.share_l3(info.id, placement.consumer) ? near : far).push_back(info.id);
+			}
+			detail::spread_cores(topology, near);
+			detail::spread_cores(topology, far);
+			near.insert(near.end(), far.begin(), far.end());
+			if (near.empty())
+			{
+				near.push_back(placement.consumer);
+			}
+			for (unsigned i = 0; i < producers; ++i)
+			{
+				placement.producers.push_back(near[i % near.size()]);
+			}
+			return placement;
+		}
+
+		// A placement with every producer at exactly the given distance from
+		// the consumer, for measuring one cache level at a time. The consumer
+		// is the first CPU (isolated ones first) that has such neighbours;
+		// producers wrap around them. Empty when the machine has no such pair,
+		// e.g. other_package on a single socket.
+		inline std::optional<Placement> place_at(const Topology& topology, Distance distance, unsigned producers)
+		{
+			std::vector<unsigned> order = topology.isolated();
+			for (const CpuInfo& info : topology.cpus())
+			{
+				if (!info.isolated)
+				{
+					order.push_back(info.id);
+				}
+			}
+			for (unsigned consumer : order)
+			{
+				std::vector<unsigned> candidates;
+				for (const CpuInfo& info : topology.cpus())
+				{
+					if (topology.distance(consumer, info.id) == distance)
+					{
+						candidates.push_back(info.id);
+					}
+				}
+				if (candidates.empty())
+				{
+					continue;
+				}
+				detail::spread_cores(topology, candidates);
+				Placement placement{ consumer, {} };
+				for (unsigned i = 0; i < producers; ++i)
+				{
+					placement.producers.push_back(candidates[i % candidates.size()]);
+				}
+				return placement;
+			}
+			return std::nullopt;
+		}
+
+	}
+}
+
+#endif // !GREEZEZ_MPSCTOPOLOGY_HPP
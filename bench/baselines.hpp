@@ -0,0 +1,160 @@
+#pragma once
+#ifndef GREEZEZ_MPSC_BENCH_BASELINES_HPP
+#define GREEZEZ_MPSC_BENCH_BASELINES_HPP
+
+// Queues the engines are compared against in mpsc_bench --compare. Each one
+// exposes the queue-like interface Produser and Consumer work over
+// (value_type, try_emplace, try_pop), so the benchmark drives all of them
+// through the same code.
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <span>
+#include <type_traits>
+#include <utility>
+
+#include "../MPSCQueue.hpp"
+
+namespace bench
+{
+
+	// The usual starting point: a deque behind a mutex, consumer polling.
+	template<typename T>
+	class MutexDeque
+	{
+	public:
+		using value_type = T;
+
+		template<typename... Args>
+		bool try_emplace(Args&&... args)
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			items_.emplace_back(std::forward<Args>(args)...);
+			return true;
+		}
+
+		bool try_pop(T& out)
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (items_.empty())
+			{
+				return false;
+			}
+			out = std::move(items_.front());
+			items_.pop_front();
+			return true;
+		}
+
+		greezez::mpsc::Produser<MutexDeque> produser()
+		{
+			return greezez::mpsc::Produser<MutexDeque>(*this);
+		}
+
+		greezez::mpsc::Consumer<MutexDeque> consumer()
+		{
+			return greezez::mpsc::Consumer<MutexDeque>(*this);
+		}
+
+	private:
+		std::mutex mutex_;
+		std::deque<T> items_;
+	};
+
+	// The blocking variant: the consumer sleeps on a condition variable and
+	// every push notifies it. The counterpart of wait::park.
+	template<typename T>
+	class CondVarQueue
+	{
+	public:
+		using value_type = T;
+
+		template<typename... Args>
+		bool try_emplace(Args&&... args)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				items_.emplace_back(std::forward<Args>(args)...);
+			}
+			ready_.notify_one();
+			return true;
+		}
+
+		bool try_pop(T& out)
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (items_.empty())
+			{
+				return false;
+			}
+			out = std::move(items_.front());
+			items_.pop_front();
+			return true;
+		}
+
+		void wait_readable()
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			ready_.wait(lock, [this] { return !items_.empty(); });
+		}
+
+		greezez::mpsc::Produser<CondVarQueue> produser()
+		{
+			return greezez::mpsc::Produser<CondVarQueue>(*this);
+		}
+
+		greezez::mpsc::Consumer<CondVarQueue> consumer()
+		{
+			return greezez::mpsc::Consumer<CondVarQueue>(*this);
+		}
+
+	private:
+		std::mutex mutex_;
+		std::condition_variable ready_;
+		std::deque<T> items_;
+	};
+
+	// ByteRing carrying a trivially copyable T as one record per value, so the
+	// byte engine runs the same workload as the typed ones.
+	template<typename T, greezez::mpsc::CommitOrder Order = greezez::mpsc::CommitOrder::in_order>
+	class ByteRingQueue
+	{
+		static_assert(std::is_trivially_copyable_v<T>, "ByteRingQueue copies values as bytes");
+
+	public:
+		using value_type = T;
+
+		explicit ByteRingQueue(std::size_t capacity)
+			: ring_(capacity)
+		{
+		}
+
+		bool try_emplace(const T& value) noexcept
+		{
+			return ring_.try_push(std::as_bytes(std::span<const T, 1>(&value, 1)));
+		}
+
+		bool try_pop(T& out) noexcept
+		{
+			return ring_.consume([&](std::span<const std::byte> record) { std::memcpy(&out, record.data(), sizeof(T)); }, 1) == 1;
+		}
+
+		greezez::mpsc::Produser<ByteRingQueue> produser()
+		{
+			return greezez::mpsc::Produser<ByteRingQueue>(*this);
+		}
+
+		greezez::mpsc::Consumer<ByteRingQueue> consumer()
+		{
+			return greezez::mpsc::Consumer<ByteRingQueue>(*this);
+		}
+
+	private:
+		greezez::mpsc::ByteRing<Order> ring_;
+	};
+
+}
+
+#endif // !GREEZEZ_MPSC_BENCH_BASELINES_HPP
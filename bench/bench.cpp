@@ -0,0 +1,641 @@
+// Throughput benchmark.
+//
+// P producers push M messages in total into one consumer, each thread
+// pinned according to a Placement (see MPSCTopology.hpp), and the best of
+// --repeat runs is reported per engine. Without --consumer/--producer-cpus
+// the placement comes from plan_placement(): consumer on an isolated CPU if
+// there is one, producers on CPUs sharing its L3 first.
+//
+// --micro times the primitives on their own instead: uncontended push, push
+// under --producers-way contention, pop with items present, pop on an empty
+// queue and the wake-up latency of a parked consumer, in ns and cycles per
+// operation.
+//
+// --perf adds hardware counters per message to the throughput runs:
+// instructions, cache misses, LLC misses, HITM loads (lines pulled out of
+// another core's cache in Modified state, i.e. the ping-pong the queue
+// layout is meant to avoid) and branch misses. --hitm-event gives the raw
+// PMU encoding where the Intel default doesn't apply, e.g. on AMD.
+//
+// --compare runs the throughput workload through a mutex + deque and a
+// condition_variable queue as well as every engine (the byte ring included)
+// and prints each engine's speedup over both.
+//
+// --matrix instead runs every engine once per placement class that the
+// machine offers (producers on the consumer's SMT sibling, on cores sharing
+// its L3, on another L3, on another socket) and prints a table showing where
+// each engine falls off.
+//
+//   mpsc_bench [--producers N] [--messages N] [--repeat N]
+//              [--consumer CPU] [--producer-cpus A,B,...] [--no-pin] [--topology]
+//              [--perf] [--hitm-event RAW] [--micro | --compare | --matrix]
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../MPSCQueue.hpp"
+#include "../MPSCTopology.hpp"
+#include "baselines.hpp"
+#include "perf_counters.hpp"
+
+namespace bench
+{
+
+	using namespace greezez::mpsc;
+	using clock = std::chrono::steady_clock;
+
+	struct Config
+	{
+		unsigned producers = 2;
+		std::uint64_t messages = 2000000;
+		unsigned repeat = 3;
+		bool pin = true;
+		bool perf = false;
+		std::uint64_t hitm_event = 0;
+	};
+
+	struct Result
+	{
+		double seconds;
+		std::uint64_t messages;
+		// Per PerfCounters::Event, negative when not measured.
+		std::array<double, PerfCounters::event_count> events;
+	};
+
+	inline void pin(const Config& config, unsigned cpu)
+	{
+		static std::atomic<bool> warned{ false };
+		if (config.pin && !pin_this_thread(cpu) && !warned.exchange(true))
+		{
+			std::fprintf(stderr, "warning: could not pin to cpu %u, running unpinned\n", cpu);
+		}
+	}
+
+	// Holds every thread until all of them are pinned and waiting, then
+	// releases them together.
+	class StartGate
+	{
+	public:
+		explicit StartGate(unsigned threads)
+			: waiting_(threads)
+		{
+		}
+
+		void arrive_and_wait() noexcept
+		{
+			waiting_.fetch_sub(1, std::memory_order_acq_rel);
+			while (waiting_.load(std::memory_order_acquire) != 0)
+			{
+				std::this_thread::yield();
+			}
+		}
+
+	private:
+		std::atomic<unsigned> waiting_;
+	};
+
+	template<typename Queue, typename... Args>
+	Result run_throughput(const Config& config, const Placement& placement, Args... args)
+	{
+		Queue queue(args...);
+		StartGate gate(config.producers + 1);
+		std::uint64_t per_producer = config.messages / config.producers;
+		std::uint64_t total = per_producer * config.producers;
+
+		std::vector<std::thread> producers;
+		for (unsigned p = 0; p < config.producers; ++p)
+		{
+			producers.emplace_back([&, p]
+			{
+				pin(config, placement.producers[p]);
+				auto produser = queue.produser();
+				gate.arrive_and_wait();
+				for (std::uint64_t i = 0; i < per_producer; ++i)
+				{
+					while (!produser.push(i))
+					{
+						detail::cpu_relax();
+					}
+				}
+			});
+		}
+
+		double seconds = 0;
+		std::thread consumer_thread([&]
+		{
+			pin(config, placement.consumer);
+			auto consumer = queue.consumer();
+			std::uint64_t value;
+			gate.arrive_and_wait();
+			auto start = clock::now();
+			for (std::uint64_t received = 0; received < total; ++received)
+			{
+				// Queues with a wait strategy (and the condition variable
+				// baseline) wait through it; the rest poll.
+				if constexpr (requires { consumer.wait_pop(value); })
+				{
+					consumer.wait_pop(value);
+				}
+				else
+				{
+					while (!consumer.pop(value))
+					{
+						detail::cpu_relax();
+					}
+				}
+			}
+			seconds = std::chrono::duration<double>(clock::now() - start).count();
+		});
+
+		for (std::thread& thread : producers)
+		{
+			thread.join();
+		}
+		consumer_thread.join();
+		Result result{ seconds, total, {} };
+		result.events.fill(-1);
+		return result;
+	}
+
+	inline void warn_no_counters()
+	{
+		static std::atomic<bool> warned{ false };
+		if (!warned.exchange(true))
+		{
+			std::fprintf(stderr, "warning: no hardware counters available (no PMU, or see /proc/sys/kernel/perf_event_paranoid)\n");
+		}
+	}
+
+	struct Measurement
+	{
+		const char* engine;
+		double rate;
+	};
+
+	template<typename Queue, typename... Args>
+	Measurement report(const char* name, const Config& config, const Placement& placement, Args... args)
+	{
+		// Opened here, before run_throughput starts its threads, so that they
+		// inherit the counters. Queue construction and thread start-up are
+		// counted too; both are small next to the messages.
+		std::optional<PerfCounters> counters;
+		if (config.perf)
+		{
+			counters.emplace(config.hitm_event);
+			if (!counters->any())
+			{
+				warn_no_counters();
+			}
+		}
+
+		Result best{ 0, 0, {} };
+		for (unsigned run = 0; run < config.repeat; ++run)
+		{
+			if (counters)
+			{
+				counters->start();
+			}
+			Result result = run_throughput<Queue>(config, placement, args...);
+			if (counters)
+			{
+				counters->stop();
+				for (int event = 0; event < PerfCounters::event_count; ++event)
+				{
+					double value;
+					if (counters->read(static_cast<PerfCounters::Event>(event), value))
+					{
+						result.events[event] = value;
+					}
+				}
+			}
+			if (best.messages == 0 || result.seconds < best.seconds)
+			{
+				best = result;
+			}
+		}
+		double rate = static_cast<double>(best.messages) / best.seconds;
+		std::printf("%-24s %10.2f Mmsg/s %10.1f ns/msg\n", name, rate / 1e6, 1e9 / rate);
+		if (counters)
+		{
+			std::printf("%-24s", "  per msg:");
+			for (int event = 0; event < PerfCounters::event_count; ++event)
+			{
+				std::printf(" %s ", PerfCounters::name(static_cast<PerfCounters::Event>(event)));
+				if (best.events[event] < 0)
+				{
+					std::printf("-");
+				}
+				else
+				{
+					std::printf("%.3g", best.events[event] / static_cast<double>(best.messages));
+				}
+			}
+			std::printf("\n");
+		}
+		return { name, rate };
+	}
+
+	inline std::vector<Measurement> run_all(const Config& config, const Placement& placement)
+	{
+		return {
+			report<queue<std::uint64_t>>("linked", config, placement),
+			report<queue<std::uint64_t, wait::park<>>>("linked park", config, placement),
+			report<queue<std::uint64_t, engine::ring>>("ring 1024", config, placement, std::size_t(1024)),
+			report<queue<std::uint64_t, engine::ring>>("ring 65536", config, placement, std::size_t(65536)),
+		};
+	}
+
+	// Same workload through the in-tree baselines and every engine, then each
+	// engine's throughput as a multiple of the baselines'.
+	inline void run_compare(const Config& config, const Placement& placement)
+	{
+		std::vector<Measurement> baselines = {
+			report<MutexDeque<std::uint64_t>>("mutex + deque", config, placement),
+			report<CondVarQueue<std::uint64_t>>("condition_variable", config, placement),
+		};
+		std::vector<Measurement> engines = run_all(config, placement);
+		engines.push_back(report<ByteRingQueue<std::uint64_t>>("byte ring 64k", config, placement, std::size_t(65536)));
+		engines.push_back(report<ByteRingQueue<std::uint64_t, CommitOrder::any>>("byte ring 64k any", config, placement, std::size_t(65536)));
+
+		std::printf("\n%-24s %10s", "speedup", "Mmsg/s");
+		for (const Measurement& baseline : baselines)
+		{
+			std::printf(" %20s", ("vs " + std::string(baseline.engine)).c_str());
+		}
+		std::printf("\n");
+		for (const Measurement& engine : engines)
+		{
+			std::printf("%-24s %10.2f", engine.engine, engine.rate / 1e6);
+			for (const Measurement& baseline : baselines)
+			{
+				std::printf(" %19.2fx", engine.rate / baseline.rate);
+			}
+			std::printf("\n");
+		}
+	}
+
+	// Per-primitive costs, so a regression in one of them can't hide inside
+	// the aggregate throughput. Cycles are TSC ticks (reference cycles, not
+	// core clocks at the current frequency); ns are derived from them.
+	inline void print_micro(const char* engine, const char* primitive, double ticks_per_op)
+	{
+		double ns = ticks_per_op * 1e9 / static_cast<double>(detail::tsc_hz());
+		std::printf("%-12s %-26s %10.1f ns/op %10.1f cycles/op\n", engine, primitive, ns, ticks_per_op);
+	}
+
+	// Push and pop timed in batches on one thread, with nothing else touching
+	// the queue, plus try-pops on an empty queue (the cost of one poll).
+	template<typename Queue, typename... Args>
+	void micro_uncontended(const char* name, const Config& config, const Placement& placement, Args... args)
+	{
+		constexpr std::uint64_t batch = 1024;
+		std::uint64_t rounds = std::max<std::uint64_t>(1, config.messages / batch);
+		double push = 0;
+		double pop = 0;
+		double empty = 0;
+		std::thread([&]
+		{
+			pin(config, placement.consumer);
+			Queue queue(args...);
+			auto produser = queue.produser();
+			auto consumer = queue.consumer();
+			std::uint64_t value = 0;
+			std::uint64_t found = 0;
+			for (unsigned run = 0; run < config.repeat; ++run)
+			{
+				std::uint64_t push_ticks = 0;
+				std::uint64_t pop_ticks = 0;
+				for (std::uint64_t round = 0; round < rounds; ++round)
+				{
+					std::uint64_t start = detail::tsc();
+					for (std::uint64_t i = 0; i < batch; ++i)
+					{
+						produser.push(i);
+					}
+					std::uint64_t pushed = detail::tsc();
+					for (std::uint64_t i = 0; i < batch; ++i)
+					{
+						found += consumer.pop(value);
+					}
+					pop_ticks += detail::tsc() - pushed;
+					push_ticks += pushed - start;
+				}
+				std::uint64_t start = detail::tsc();
+				for (std::uint64_t i = 0; i < rounds * batch; ++i)
+				{
+					found += consumer.pop(value);
+				}
+				std::uint64_t empty_ticks = detail::tsc() - start;
+
+				double ops = static_cast<double>(rounds * batch);
+				push = run == 0 ? push_ticks / ops : std::min(push, push_ticks / ops);
+				pop = run == 0 ? pop_ticks / ops : std::min(pop, pop_ticks / ops);
+				empty = run == 0 ? empty_ticks / ops : std::min(empty, empty_ticks / ops);
+			}
+			if (found != rounds * batch * config.repeat)
+			{
+				std::fprintf(stderr, "%s: lost messages\n", name);
+			}
+		}).join();
+		print_micro(name, "push, uncontended", push);
+		print_micro(name, "pop, items present", pop);
+		print_micro(name, "pop, empty queue", empty);
+	}
+
+	// Every producer times its own pushes while all of them hammer the tail
+	// and the consumer drains; reports the mean over all pushes.
+	template<typename Queue, typename... Args>
+	void micro_contended(const char* name, const Config& config, const Placement& placement, Args... args)
+	{
+		double best = 0;
+		for (unsigned run = 0; run < config.repeat; ++run)
+		{
+			Queue queue(args...);
+			StartGate gate(config.producers + 1);
+			std::uint64_t per_producer = std::max<std::uint64_t>(1, config.messages / config.producers);
+			std::atomic<std::uint64_t> ticks{ 0 };
+			std::vector<std::thread> producers;
+			for (unsigned p = 0; p < config.producers; ++p)
+			{
+				producers.emplace_back([&, p]
+				{
+					pin(config, placement.producers[p]);
+					auto produser = queue.produser();
+					gate.arrive_and_wait();
+					std::uint64_t start = detail::tsc();
+					for (std::uint64_t i = 0; i < per_producer; ++i)
+					{
+						while (!produser.push(i))
+						{
+							detail::cpu_relax();
+						}
+					}
+					ticks.fetch_add(detail::tsc() - start, std::memory_order_relaxed);
+				});
+			}
+			std::thread consumer_thread([&]
+			{
+				pin(config, placement.consumer);
+				auto consumer = queue.consumer();
+				std::uint64_t value;
+				gate.arrive_and_wait();
+				for (std::uint64_t received = 0; received < per_producer * config.producers;)
+				{
+					received += consumer.pop(value);
+				}
+			});
+			for (std::thread& thread : producers)
+			{
+				thread.join();
+			}
+			consumer_thread.join();
+			double per_push = static_cast<double>(ticks.load()) / static_cast<double>(per_producer * config.producers);
+			best = run == 0 ? per_push : std::min(best, per_push);
+		}
+		std::string primitive = "push, " + std::to_string(config.producers) + "-way contention";
+		print_micro(name, primitive.c_str(), best);
+	}
+
+	// A producer pushes its TSC once the consumer has gone to sleep in
+	// wait_pop; the consumer records how long the value took to reach it.
+	// Reports the median over the samples.
+	template<typename Queue, typename... Args>
+	void micro_wake(const char* name, const Config& config, const Placement& placement, Args... args)
+	{
+		unsigned samples = static_cast<unsigned>(std::clamp<std::uint64_t>(config.messages / 1000, 10, 1000));
+		Queue queue(args...);
+		std::vector<std::uint64_t> latencies(samples);
+		std::atomic<unsigned> received{ 0 };
+		std::thread consumer_thread([&]
+		{
+			pin(config, placement.consumer);
+			auto consumer = queue.consumer();
+			std::uint64_t value;
+			for (unsigned s = 0; s < samples; ++s)
+			{
+				consumer.wait_pop(value);
+				latencies[s] = detail::tsc() - value;
+				received.store(s + 1, std::memory_order_release);
+			}
+		});
+		std::thread producer_thread([&]
+		{
+			pin(config, placement.producers[0]);
+			auto produser = queue.produser();
+			for (unsigned s = 0; s < samples; ++s)
+			{
+				// Long enough for the consumer to finish spinning and park.
+				std::this_thread::sleep_for(std::chrono::microseconds(200));
+				produser.push(detail::tsc());
+				while (received.load(std::memory_order_acquire) != s + 1)
+				{
+					std::this_thread::yield();
+				}
+			}
+		});
+		producer_thread.join();
+		consumer_thread.join();
+		std::nth_element(latencies.begin(), latencies.begin() + samples / 2, latencies.end());
+		print_micro(name, "wake parked consumer", static_cast<double>(latencies[samples / 2]));
+	}
+
+	template<typename Engine, typename... Args>
+	void micro_engine(const char* name, const Config& config, const Placement& placement, Args... args)
+	{
+		micro_uncontended<queue<std::uint64_t, Engine>>(name, config, placement, args...);
+		micro_contended<queue<std::uint64_t, Engine>>(name, config, placement, args...);
+		micro_wake<queue<std::uint64_t, Engine, wait::park<>>>(name, config, placement, args...);
+	}
+
+	inline void run_micro(const Config& config, const Placement& placement)
+	{
+		micro_engine<engine::linked<>>("linked", config, placement);
+		micro_engine<engine::ring>("ring 1024", config, placement, std::size_t(1024));
+	}
+
+	// Runs every engine with the producers at each distance from the consumer
+	// that this machine has, then prints Mmsg/s as an engine x distance table.
+	inline void run_matrix(const Config& config, const Topology& topology)
+	{
+		const Distance distances[] = { Distance::smt_sibling, Distance::shared_l3, Distance::other_l3, Distance::other_package };
+		std::vector<std::vector<Measurement>> columns;
+		for (Distance distance : distances)
+		{
+			std::optional<Placement> placement = place_at(topology, distance, config.producers);
+			std::printf("\n== %s: ", to_string(distance));
+			if (!placement)
+			{
+				std::printf("no such CPU pair on this machine\n");
+				columns.emplace_back();
+				continue;
+			}
+			std::printf("%s\n", placement->describe(topology).c_str());
+			columns.push_back(run_all(config, *placement));
+		}
+
+		std::printf("\n%-24s", "Mmsg/s");
+		for (Distance distance : distances)
+		{
+			std::printf(" %14s", to_string(distance));
+		}
+		std::printf("\n");
+		std::size_t rows = 0;
+		for (const std::vector<Measurement>& column : columns)
+		{
+			rows = std::max(rows, column.size());
+		}
+		for (std::size_t row = 0; row < rows; ++row)
+		{
+			const char* engine = nullptr;
+			for (const std::vector<Measurement>& column : columns)
+			{
+				if (row < column.size())
+				{
+					engine = column[row].engine;
+				}
+			}
+			std::printf("%-24s", engine);
+			for (const std::vector<Measurement>& column : columns)
+			{
+				if (row < column.size())
+				{
+					std::printf(" %14.2f", column[row].rate / 1e6);
+				}
+				else
+				{
+					std::printf(" %14s", "-");
+				}
+			}
+			std::printf("\n");
+		}
+	}
+
+}
+
+int main(int argc, char** argv)
+{
+	using namespace greezez::mpsc;
+
+	bench::Config config;
+	config.hitm_event = bench::default_hitm_event();
+	Topology topology = Topology::detect();
+	bool show_topology = false;
+	bool matrix = false;
+	bool micro = false;
+	bool compare = false;
+	int consumer = -1;
+	std::vector<unsigned> producer_cpus;
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		auto value = [&] { return i + 1 < argc ? std::string(argv[++i]) : std::string("0"); };
+		if (arg == "--producers")
+		{
+			config.producers = static_cast<unsigned>(std::stoul(value()));
+		}
+		else if (arg == "--messages")
+		{
+			config.messages = std::stoull(value());
+		}
+		else if (arg == "--repeat")
+		{
+			config.repeat = static_cast<unsigned>(std::stoul(value()));
+		}
+		else if (arg == "--consumer")
+		{
+			consumer = std::stoi(value());
+		}
+		else if (arg == "--producer-cpus")
+		{
+			producer_cpus = detail::parse_cpu_list(value());
+		}
+		else if (arg == "--no-pin")
+		{
+			config.pin = false;
+		}
+		else if (arg == "--topology")
+		{
+			show_topology = true;
+		}
+		else if (arg == "--matrix")
+		{
+			matrix = true;
+		}
+		else if (arg == "--micro")
+		{
+			micro = true;
+		}
+		else if (arg == "--compare")
+		{
+			compare = true;
+		}
+		else if (arg == "--perf")
+		{
+			config.perf = true;
+		}
+		else if (arg == "--hitm-event")
+		{
+			config.hitm_event = std::stoull(value(), nullptr, 0);
+		}
+		else
+		{
+			std::fprintf(stderr, "usage: %s [--producers N] [--messages N] [--repeat N] [--consumer CPU] "
+				"[--producer-cpus A,B,...] [--no-pin] [--topology] [--perf] [--hitm-event RAW] [--micro | --compare | --matrix]\n", argv[0]);
+			return 2;
+		}
+	}
+	if (config.producers == 0 || config.repeat == 0)
+	{
+		std::fprintf(stderr, "--producers and --repeat must be at least 1\n");
+		return 2;
+	}
+
+	if (show_topology)
+	{
+		std::printf("%s", topology.describe().c_str());
+	}
+	std::printf("kernels: %s\n", detail::kernels().isa);
+	if (matrix)
+	{
+		std::printf("%u producers, %llu messages, best of %u\n", config.producers,
+			static_cast<unsigned long long>(config.messages), config.repeat);
+		bench::run_matrix(config, topology);
+		return 0;
+	}
+
+	Placement placement = plan_placement(topology, config.producers);
+	if (consumer >= 0)
+	{
+		placement.consumer = static_cast<unsigned>(consumer);
+	}
+	for (unsigned p = 0; p < config.producers && !producer_cpus.empty(); ++p)
+	{
+		placement.producers[p] = producer_cpus[p % producer_cpus.size()];
+	}
+
+	std::printf("%s%s\n", placement.describe(topology).c_str(), config.pin ? "" : " (not pinned)");
+	std::printf("%u producers, %llu messages, best of %u\n", config.producers,
+		static_cast<unsigned long long>(config.messages), config.repeat);
+	if (micro)
+	{
+		bench::run_micro(config, placement);
+	}
+	else if (compare)
+	{
+		bench::run_compare(config, placement);
+	}
+	else
+	{
+		bench::run_all(config, placement);
+	}
+	return 0;
+}
@@ -0,0 +1,188 @@
+#pragma once
+#ifndef GREEZEZ_MPSC_BENCH_PERF_COUNTERS_HPP
+#define GREEZEZ_MPSC_BENCH_PERF_COUNTERS_HPP
+
+// Hardware performance counters for the benchmarks through perf_event_open,
+// no perf tool needed. Linux only; elsewhere no counter opens.
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+namespace bench
+{
+
+	// Counts in the calling thread and in every thread it creates while the
+	// counters are open (inherit), so open them before starting the benchmark
+	// threads and read them after joining. Each event is a separate counter,
+	// scaled if the kernel had to multiplex it. User space only, which works
+	// with the default perf_event_paranoid of 2.
+	class PerfCounters
+	{
+	public:
+
+		enum Event
+		{
+			instructions,
+			cache_misses,
+			llc_misses,
+			hitm,
+			branch_misses,
+			event_count
+		};
+
+		static const char* name(Event event) noexcept
+		{
+			static const char* const names[event_count] = { "instr", "cache-miss", "llc-miss", "hitm", "branch-miss" };
+			return names[event];
+		}
+
+		// hitm_event is the raw PMU encoding of the HITM/snoop event, 0 to skip
+		// it; see default_hitm_event().
+		explicit PerfCounters(std::uint64_t hitm_event)
+		{
+			for (int& fd : fds_)
+			{
+				fd = -1;
+			}
+#if defined(__linux__)
+			fds_[instructions] = open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+			fds_[cache_misses] = open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+			fds_[llc_misses] = open(PERF_TYPE_HW_CACHE,
+				PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+			if (hitm_event != 0)
+			{
+				fds_[hitm] = open(PERF_TYPE_RAW, hitm_event);
+			}
+			fds_[branch_misses] = open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+#else
+			(void)hitm_event;
+#endif
+		}
+
+		PerfCounters(const PerfCounters&) = delete;
+		PerfCounters& operator=(const PerfCounters&) = delete;
+
+		~PerfCounters()
+		{
+#if defined(__linux__)
+			for (int fd : fds_)
+			{
+				if (fd >= 0)
+				{
+					close(fd);
+				}
+			}
+#endif
+		}
+
+		// False when no counter could be opened (no PMU in the VM, paranoid
+		// setting, not Linux).
+		bool any() const noexcept
+		{
+			for (int fd : fds_)
+			{
+				if (fd >= 0)
+				{
+					return true;
+				}
+			}
+			return false;
+		}
+
+		void start() noexcept
+		{
+#if defined(__linux__)
+			control(PERF_EVENT_IOC_RESET);
+			control(PERF_EVENT_IOC_ENABLE);
+#endif
+		}
+
+		void stop() noexcept
+		{
+#if defined(__linux__)
+			control(PERF_EVENT_IOC_DISABLE);
+#endif
+		}
+
+		// The count since start(), false if the event isn't available.
+		bool read(Event event, double& value) const noexcept
+		{
+#if defined(__linux__)
+			std::uint64_t data[3];
+			if (fds_[event] < 0 || ::read(fds_[event], data, sizeof(data)) != static_cast<ssize_t>(sizeof(data)) || data[2] == 0)
+			{
+				return false;
+			}
+			// value, time enabled, time running
+			value = static_cast<double>(data[0]) * static_cast<double>(data[1]) / static_cast<double>(data[2]);
+			return true;
+#else
+			(void)event;
+			(void)value;
+			return false;
+#endif
+		}
+
+	private:
+
+#if defined(__linux__)
+		static int open(std::uint32_t type, std::uint64_t config) noexcept
+		{
+			perf_event_attr attr;
+			std::memset(&attr, 0, sizeof(attr));
+			attr.size = sizeof(attr);
+			attr.type = type;
+			attr.config = config;
+			attr.disabled = 1;
+			attr.inherit = 1;
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+			return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+		}
+
+		void control(unsigned long request) noexcept
+		{
+			for (int fd : fds_)
+			{
+				if (fd >= 0)
+				{
+					ioctl(fd, request, 0);
+				}
+			}
+		}
+#endif
+
+		int fds_[event_count];
+	};
+
+	// Loads that hit a line modified in another core's cache: event 0xd2
+	// umask 0x04 on Intel since Skylake (MEM_LOAD_L3_HIT_RETIRED.XSNP_HITM,
+	// renamed XSNP_FWD from Ice Lake on). Other vendors have no single
+	// equivalent, so there it has to be passed explicitly (--hitm-event).
+	inline std::uint64_t default_hitm_event() noexcept
+	{
+#if defined(__x86_64__) || defined(__i386__)
+		unsigned a, b, c, d;
+		if (__get_cpuid(0, &a, &b, &c, &d) && b == 0x756e6547 && d == 0x49656e69 && c == 0x6c65746e) // "GenuineIntel"
+		{
+			return 0x04d2;
+		}
+#endif
+		return 0;
+	}
+
+}
+
+#endif // !GREEZEZ_MPSC_BENCH_PERF_COUNTERS_HPP
@@ -0,0 +1,1153 @@
+// Randomized stress test for every engine.
+//
+// Producers push (producer, seq) messages under randomized schedules with
+// yields injected inside the engines (GREEZEZ_MPSC_STRESS_POINT); the consumer
+// switches between its pop paths at random and checks that each producer's
+// messages arrive exactly once and in order. Observer threads walk the
+// engines that support it at the same time.
+//
+//   stress_test [--seed N] [--rounds N] [--messages N] [--litmus]
+//
+// --litmus replaces the long runs with many tiny ones (fresh queue, two
+// producers released together, a handful of messages) which keeps threads
+// racing on the empty/full transitions where weak memory orders show up.
+// Build it with -fsanitize=thread as well; the snapshot observer is skipped
+// there since its seqlock-style copy is a deliberate race. ThreadSanitizer
+// does not model atomic_thread_fence, so it checks the data handed over by
+// release/acquire pairs but not the fence-based handshakes in wait::park
+// and EpochReclaim; those rely on the litmus runs.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory_resource>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace stress
+{
+
+	// Per mille chance that a stress point yields.
+	inline std::atomic<unsigned> yield_rate{ 20 };
+
+	inline std::minstd_rand& rng()
+	{
+		thread_local std::minstd_rand engine(std::random_device{}());
+		return engine;
+	}
+
+	// Set on a thread to hold it at its next stress point until the flag
+	// clears, so a test can stall a producer inside a known window.
+	inline thread_local std::atomic<bool>* hold_at_point = nullptr;
+	inline std::atomic<bool> held{ false };
+
+	inline void maybe_yield()
+	{
+		if (std::atomic<bool>* hold = std::exchange(hold_at_point, nullptr))
+		{
+			held.store(true);
+			while (hold->load())
+			{
+				std::this_thread::yield();
+			}
+			return;
+		}
+		unsigned rate = yield_rate.load(std::memory_order_relaxed);
+		if (rate != 0 && rng()() % 1000 < rate)
+		{
+			std::this_thread::yield();
+		}
+	}
+
+	// Trace probe hits, counted per thread and added up as each thread
+	// exits, so counting puts no shared writes into the schedules under test.
+	// Every push probe must be matched by a pop probe once a run is drained.
+	inline std::atomic<std::uint64_t> probe_pushes{ 0 };
+	inline std::atomic<std::uint64_t> probe_pops{ 0 };
+
+	struct ProbeTally
+	{
+		std::uint64_t pushes = 0;
+		std::uint64_t pops = 0;
+
+		~ProbeTally()
+		{
+			probe_pushes += pushes;
+			probe_pops += pops;
+		}
+	};
+
+	inline thread_local ProbeTally probe_tally;
+
+	inline void probe_push()
+	{
+		++probe_tally.pushes;
+	}
+
+	inline void probe_pop()
+	{
+		++probe_tally.pops;
+	}
+
+	inline void probe_full()
+	{
+	}
+
+	inline void probe_park()
+	{
+	}
+
+	inline void probe_wake()
+	{
+	}
+
+}
+
+#define GREEZEZ_MPSC_STRESS_POINT() ::stress::maybe_yield()
+#define GREEZEZ_MPSC_PROBE(name, object, position, size) ::stress::probe_##name()
+
+#include "../MPSCQueue.hpp"
+
+namespace stress
+{
+
+	using namespace greezez::mpsc;
+
+	struct Message
+	{
+		std::uint32_t producer;
+		std::uint32_t seq;
+	};
+
+	struct Config
+	{
+		std::uint32_t seed = 0;
+		unsigned rounds = 2;
+		std::uint32_t messages = 10000;
+		unsigned producers = 3;
+		bool litmus = false;
+	};
+
+	inline std::atomic<int> failures{ 0 };
+
+	inline void fail(const char* test, const char* what, std::uint32_t seed)
+	{
+		std::fprintf(stderr, "FAIL %s: %s (seed %u)\n", test, what, seed);
+		++failures;
+	}
+
+	// Checks per-producer FIFO order, no duplicates and, at the end, no loss.
+	class Checker
+	{
+	public:
+		Checker(const char* test, unsigned producers, std::uint32_t messages, std::uint32_t seed)
+			: test_(test), next_(producers, 0), messages_(messages), seed_(seed)
+		{
+		}
+
+		void see(const Message& message)
+		{
+			if (message.producer >= next_.size())
+			{
+				fail(test_, "unknown producer", seed_);
+				return;
+			}
+			if (message.seq != next_[message.producer])
+			{
+				fail(test_, message.seq < next_[message.producer] ? "duplicate or reordered message" : "lost message", seed_);
+				next_[message.producer] = message.seq;
+			}
+			++next_[message.producer];
+			++seen_;
+		}
+
+		std::size_t remaining() const
+		{
+			return next_.size() * messages_ - seen_;
+		}
+
+		void finish() const
+		{
+			for (std::uint32_t next : next_)
+			{
+				if (next != messages_)
+				{
+					fail(test_, "message count mismatch", seed_);
+					return;
+				}
+			}
+		}
+
+	private:
+		const char* test_;
+		std::vector<std::uint32_t> next_;
+		std::uint32_t messages_;
+		std::uint32_t seed_;
+		std::size_t seen_ = 0;
+	};
+
+	// Starts all producers together so they race from the first push.
+	class StartGate
+	{
+	public:
+		void wait() const
+		{
+			while (!open_.load(std::memory_order_acquire))
+			{
+				std::this_thread::yield();
+			}
+		}
+
+		void open()
+		{
+			open_.store(true, std::memory_order_release);
+		}
+
+	private:
+		std::atomic<bool> open_{ false };
+	};
+
+	// Walks the pending messages while the consumer runs; within one walk each
+	// producer's messages must be strictly increasing.
+	class OrderWatch
+	{
+	public:
+		explicit OrderWatch(unsigned producers)
+			: last_(producers)
+		{
+		}
+
+		void reset()
+		{
+			std::fill(last_.begin(), last_.end(), -1);
+		}
+
+		bool see(const Message& message)
+		{
+			if (message.producer >= last_.size() || static_cast<std::int64_t>(message.seq) <= last_[message.producer])
+			{
+				return false;
+			}
+			last_[message.producer] = message.seq;
+			return true;
+		}
+
+	private:
+		std::vector<std::int64_t> last_;
+	};
+
+	template<typename Produser>
+	void produce(Produser& produser, unsigned id, const Config& config, const StartGate& gate)
+	{
+		gate.wait();
+		auto& random = rng();
+		for (std::uint32_t seq = 0; seq < config.messages; ++seq)
+		{
+			Message message{ id, seq };
+			bool pushed = random() & 1 ? produser.push(message) : produser.emplace(message);
+			while (!pushed)
+			{
+				std::this_thread::yield();
+				pushed = produser.push(message);
+			}
+			if (random() % 64 == 0)
+			{
+				std::this_thread::yield();
+			}
+		}
+	}
+
+	// One consumer step through a randomly chosen pop path; yields when it
+	// finds nothing so spinning stays cheap on machines with few cores.
+	template<typename Consumer>
+	void consume_step(Consumer& consumer, Checker& checker)
+	{
+		std::size_t before = checker.remaining();
+		Message message;
+		switch (rng()() % 4)
+		{
+		case 0:
+			if (consumer.pop(message))
+			{
+				checker.see(message);
+			}
+			break;
+		case 1:
+			consumer.drain([&](Message&& value) { checker.see(value); }, 1 + rng()() % 32);
+			break;
+		case 2:
+			if constexpr (requires { consumer.readable_spans(); })
+			{
+				auto spans = consumer.readable_spans(1 + rng()() % 64);
+				std::size_t count = 0;
+				for (auto span : spans)
+				{
+					for (const Message& value : span)
+					{
+						checker.see(value);
+						++count;
+					}
+				}
+				consumer.advance(count);
+				break;
+			}
+			[[fallthrough]];
+		default:
+			if constexpr (requires { consumer.wait_pop(message); })
+			{
+				if (checker.remaining() != 0)
+				{
+					consumer.wait_pop(message);
+					checker.see(message);
+				}
+			}
+			break;
+		}
+		if (checker.remaining() == before)
+		{
+			std::this_thread::yield();
+		}
+	}
+
+	template<typename Queue, typename Observe, typename... Args>
+	void run_queue(const char* name, const Config& config, Observe observe, Args... args)
+	{
+		for (unsigned round = 0; round < config.rounds; ++round)
+		{
+			std::uint32_t seed = config.seed + round;
+			rng().seed(seed);
+			Queue queue(args...);
+			StartGate gate;
+			std::atomic<bool> done{ false };
+			std::vector<std::thread> threads;
+			for (unsigned id = 0; id < config.producers; ++id)
+			{
+				threads.emplace_back([&, id]
+				{
+					rng().seed(seed * 31 + id);
+					auto produser = queue.produser();
+					produce(produser, id, config, gate);
+				});
+			}
+			std::thread observer([&]
+			{
+				OrderWatch watch(config.producers);
+				while (!done.load(std::memory_order_relaxed))
+				{
+					watch.reset();
+					if (!observe(queue, watch))
+					{
+						fail(name, "observer saw producer order broken", seed);
+						return;
+					}
+					std::this_thread::yield();
+				}
+			});
+
+			Checker checker(name, config.producers, config.messages, seed);
+			auto consumer = queue.consumer();
+			gate.open();
+			while (checker.remaining() != 0 && failures == 0)
+			{
+				consume_step(consumer, checker);
+			}
+			for (auto& thread : threads)
+			{
+				thread.join();
+			}
+			done.store(true, std::memory_order_relaxed);
+			observer.join();
+			checker.finish();
+		}
+		std::printf("%-40s ok\n", name);
+	}
+
+	// Adaptive runs the AdaptiveBatchingConsumer through wait_poll instead.
+	template<typename Queue, std::size_t N, bool Adaptive = false, typename... Args>
+	void run_batching(const char* name, const Config& config, Args... args)
+	{
+		for (unsigned round = 0; round < config.rounds; ++round)
+		{
+			std::uint32_t seed = config.seed + round;
+			Queue queue(args...);
+			StartGate gate;
+			std::vector<std::thread> threads;
+			for (unsigned id = 0; id < config.producers; ++id)
+			{
+				threads.emplace_back([&, id]
+				{
+					rng().seed(seed * 31 + id);
+					auto produser = queue.produser();
+					produce(produser, id, config, gate);
+				});
+			}
+
+			Checker checker(name, config.producers, config.messages, seed);
+			std::conditional_t<Adaptive, AdaptiveBatchingConsumer<Queue, N>, BatchingConsumer<Queue, N>> consumer(
+				queue, std::chrono::microseconds(50));
+			auto handle = [&](std::span<Message> batch)
+			{
+				if (batch.empty() || batch.size() > N)
+				{
+					fail(name, "bad batch size", seed);
+				}
+				for (const Message& message : batch)
+				{
+					checker.see(message);
+				}
+			};
+			gate.open();
+			while (checker.remaining() != 0 && failures == 0)
+			{
+				if constexpr (Adaptive)
+				{
+					consumer.wait_poll(handle);
+					if (consumer.batch_size() == 0 || consumer.batch_size() > N)
+					{
+						fail(name, "bad batch target", seed);
+					}
+				}
+				else if (consumer.poll(handle) == 0)
+				{
+					std::this_thread::yield();
+				}
+			}
+			for (auto& thread : threads)
+			{
+				thread.join();
+			}
+			checker.finish();
+		}
+		std::printf("%-40s ok\n", name);
+	}
+
+	// Every non-temporal copy kernel this CPU can run must match memcpy for
+	// any size and destination alignment, and write nothing outside the range.
+	inline void check_kernels(const char* name)
+	{
+		using Copy = void (*)(void*, const void*, std::size_t) noexcept;
+		std::vector<std::pair<const char*, Copy>> copies{ { "portable", detail::stream_portable },
+			{ "selected", detail::kernels().stream } };
+#if GREEZEZ_MPSC_X86_KERNELS
+		copies.emplace_back("sse2", detail::stream_sse2);
+		if (detail::cpu_features().avx2)
+		{
+			copies.emplace_back("avx2", detail::stream_avx2);
+		}
+		if (detail::cpu_features().avx512)
+		{
+			copies.emplace_back("avx512", detail::stream_avx512);
+		}
+#endif
+		constexpr std::size_t guard = 64;
+		constexpr std::size_t largest = 4200;
+		std::vector<std::byte> source(largest + guard);
+		for (std::size_t i = 0; i < source.size(); ++i)
+		{
+			source[i] = static_cast<std::byte>(i * 131 + 7);
+		}
+		alignas(64) static std::byte expected[guard + largest + 2 * guard];
+		alignas(64) static std::byte actual[guard + largest + 2 * guard];
+		for (auto [isa, copy] : copies)
+		{
+			for (std::size_t size = 0; size <= largest; size += size < 300 ? 1 : 97)
+			{
+				for (std::size_t offset = 0; offset < guard; ++offset)
+				{
+					const std::byte* from = source.data() + (size + offset) % guard;
+					std::memset(expected, 0xa5, sizeof(expected));
+					std::memset(actual, 0xa5, sizeof(actual));
+					std::memcpy(expected + guard + offset, from, size);
+					copy(actual + guard + offset, from, size);
+					if (std::memcmp(expected, actual, sizeof(actual)) != 0)
+					{
+						std::fprintf(stderr, "FAIL %s: %s differs from memcpy at size %zu, offset %zu\n", name, isa, size, offset);
+						++failures;
+						return;
+					}
+				}
+			}
+		}
+		std::printf("%-40s ok\n", name);
+	}
+
+	// monotonic_buffer_resource over a fixed buffer with no upstream, made
+	// safe for concurrent producers and rewound whenever nothing is live, so
+	// every round starts from an empty buffer.
+	class Arena : public std::pmr::memory_resource
+	{
+	public:
+		explicit Arena(std::span<std::byte> buffer)
+			: arena_(buffer.data(), buffer.size(), std::pmr::null_memory_resource())
+		{
+		}
+
+	private:
+		void* do_allocate(std::size_t bytes, std::size_t alignment) override
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			void* memory = arena_.allocate(bytes, alignment);
+			++live_;
+			return memory;
+		}
+
+		void do_deallocate(void*, std::size_t, std::size_t) override
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (--live_ == 0)
+			{
+				arena_.release();
+			}
+		}
+
+		bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+		{
+			return this == &other;
+		}
+
+		std::mutex mutex_;
+		std::pmr::monotonic_buffer_resource arena_;
+		std::size_t live_ = 0;
+	};
+
+	// The embedded-mode constructor refuses storage that is too small or
+	// misaligned.
+	inline void check_storage(const char* name)
+	{
+		using Ring = queue<Message, engine::ring>;
+		constexpr std::size_t alignment = Ring::engine_type::storage_alignment;
+		alignas(alignment) static std::byte storage[Ring::required_bytes(64) + alignment];
+		auto refused = [](std::span<std::byte> bytes)
+		{
+			try
+			{
+				Ring ring(std::size_t(64), bytes);
+				return false;
+			}
+			catch (const std::invalid_argument&)
+			{
+				return true;
+			}
+		};
+		if (!refused(std::span<std::byte>(storage, Ring::required_bytes(64) - 1))
+			|| !refused(std::span<std::byte>(storage + 8, Ring::required_bytes(64))))
+		{
+			fail(name, "bad storage accepted", 0);
+		}
+		std::printf("%-40s ok\n", name);
+	}
+
+	// Dedup: keyed duplicates and id 0 rejected, unkeyed pushes untouched,
+	// and an id evicted by newer ones in its bucket accepted again.
+	inline void check_dedup(const char* name)
+	{
+		queue<int> queue;
+		auto produser = queue.produser(Dedup<64, 8>());
+		auto& dedup = produser.stage<Dedup<64, 8>>();
+		if (!produser.push_keyed(5, 1) || produser.push_keyed(5, 2) || dedup.duplicates() != 1)
+		{
+			fail(name, "keyed duplicate not rejected", 0);
+		}
+		if (!produser.push_keyed(0, 3) || produser.push_keyed(0, 4) || dedup.duplicates() != 2)
+		{
+			fail(name, "id 0 not tracked", 0);
+		}
+		if (!produser.push(5) || !produser.push(5) || dedup.duplicates() != 2)
+		{
+			fail(name, "unkeyed push was filtered", 0);
+		}
+
+		// One bucket of 8 ways: the ninth id replaces the first.
+		auto single = queue.produser(Dedup<8, 8>());
+		for (std::uint64_t id = 1; id <= 9; ++id)
+		{
+			single.push_keyed(id, 0);
+		}
+		if (!single.push_keyed(1, 0) || single.push_keyed(9, 0) || single.push_keyed(3, 0))
+		{
+			fail(name, "wrong eviction", 0);
+		}
+
+		// A Produser returned by value keeps the ids its Dedup has seen.
+		auto make = [&queue]
+		{
+			auto made = queue.produser(Dedup<64, 8>());
+			made.push_keyed(7, 0);
+			return made;
+		};
+		auto moved = make();
+		auto again = std::move(moved);
+		if (again.push_keyed(7, 0) || !again.push_keyed(8, 0) || again.stage<Dedup<64, 8>>().duplicates() != 1)
+		{
+			fail(name, "moved Produser lost its ids", 0);
+		}
+
+		auto consumer = queue.consumer();
+		int value;
+		while (consumer.pop(value))
+		{
+		}
+		std::printf("%-40s ok\n", name);
+	}
+
+	// TokenBucket: a full bucket admits exactly burst back-to-back pushes,
+	// delay mode waits for tokens instead of failing, bad rates are refused.
+	inline void check_token_bucket(const char* name)
+	{
+		queue<int> queue;
+		auto limited = queue.produser(TokenBucket<>(1000, 5));
+		int admitted = 0;
+		for (int i = 0; i < 100; ++i)
+		{
+			admitted += limited.push(i);
+		}
+		if (admitted != 5 || limited.stage<TokenBucket<>>().limited() != 95)
+		{
+			fail(name, "burst not enforced", 0);
+		}
+
+		auto delayed = queue.produser(TokenBucket<OverLimit::delay>(1000, 1));
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < 6; ++i)
+		{
+			if (!delayed.push(i))
+			{
+				fail(name, "delay mode failed a push", 0);
+			}
+		}
+		if (std::chrono::steady_clock::now() - start < std::chrono::milliseconds(4))
+		{
+			fail(name, "delay mode did not wait for tokens", 0);
+		}
+
+		for (double rate : { 0.0, -1.0, std::nan("") })
+		{
+			try
+			{
+				TokenBucket<> bucket(rate, 1);
+				fail(name, "bad rate accepted", 0);
+			}
+			catch (const std::invalid_argument&)
+			{
+			}
+		}
+
+		auto consumer = queue.consumer();
+		int value;
+		while (consumer.pop(value))
+		{
+		}
+		std::printf("%-40s ok\n", name);
+	}
+
+	// CoDel over values stamped a second in the past: nothing is dropped
+	// during the first interval above target, then values go at the control
+	// law's times while ShedGate holds producers off, and an empty pop or a
+	// value back under target ends it.
+	inline void check_codel(const char* name)
+	{
+		using namespace std::chrono_literals;
+		auto stale = [](int value)
+		{
+			Stamped<int> item(value);
+			item.enqueued = detail::tsc() - detail::tsc_hz();
+			return item;
+		};
+
+		{
+			ShedSignal signal;
+			queue<Stamped<int>, engine::ring> queue(std::size_t(64));
+			auto produser = queue.produser(ShedGate(signal));
+			auto consumer = queue.consumer(CoDel<>(1ms, 20ms, &signal));
+			const CoDel<>& codel = consumer.aqm();
+			for (int i = 0; i < 8; ++i)
+			{
+				produser.push(stale(i));
+			}
+			Stamped<int> item;
+			if (!consumer.pop(item) || !consumer.pop(item) || codel.dropped() != 0 || codel.dropping())
+			{
+				fail(name, "dropped within the first interval", 0);
+			}
+			std::this_thread::sleep_for(25ms);
+			if (!consumer.pop(item) || item.value != 3 || codel.dropped() != 1 || !codel.dropping()
+				|| !signal.shedding.load())
+			{
+				fail(name, "did not start dropping after an interval", 0);
+			}
+			if (produser.push(stale(100)))
+			{
+				fail(name, "ShedGate let a push through while dropping", 0);
+			}
+			if (!consumer.pop(item) || codel.dropped() != 1)
+			{
+				fail(name, "dropped before the next drop time", 0);
+			}
+			std::this_thread::sleep_for(25ms);
+			if (!consumer.pop(item) || item.value != 6 || codel.dropped() != 2)
+			{
+				fail(name, "missed the second drop", 0);
+			}
+			while (consumer.pop(item))
+			{
+			}
+			if (codel.dropping() || signal.shedding.load() || !produser.push(stale(101)) || !consumer.pop(item))
+			{
+				fail(name, "empty pop did not end dropping", 0);
+			}
+		}
+
+		{
+			queue<Stamped<int>, engine::ring> queue(std::size_t(64));
+			auto produser = queue.produser();
+			auto consumer = queue.consumer(CoDel<AqmAction::mark>(1ms, 20ms));
+			const CoDel<AqmAction::mark>& codel = consumer.aqm();
+			produser.push(stale(0));
+			produser.push(stale(1));
+			Stamped<int> item;
+			consumer.pop(item);
+			std::this_thread::sleep_for(25ms);
+			if (!consumer.pop(item) || item.value != 1 || !item.marked || codel.marked() != 1 || codel.dropped() != 0
+				|| !codel.dropping())
+			{
+				fail(name, "mark mode did not mark", 0);
+			}
+			produser.emplace(2);
+			if (!consumer.pop(item) || item.marked || codel.dropping())
+			{
+				fail(name, "a value under target did not end marking", 0);
+			}
+		}
+		std::printf("%-40s ok\n", name);
+	}
+
+	// A producer stalled between claiming its record and writing the header
+	// must not hide records claimed after it in CommitOrder::any.
+	inline void check_byte_ring_stall(const char* name)
+	{
+		ByteRing<CommitOrder::any> ring(256);
+		std::atomic<bool> hold{ true };
+		held.store(false);
+		std::thread slow([&]
+		{
+			hold_at_point = &hold;
+			std::byte record[16] = { std::byte{ 1 } };
+			ring.try_push(record);
+		});
+		while (!held.load())
+		{
+			std::this_thread::yield();
+		}
+		std::byte record[24] = { std::byte{ 2 } };
+		std::size_t seen = 0;
+		auto count = [&](std::span<const std::byte> bytes) { seen += bytes.size(); };
+		if (!ring.try_push(record) || ring.consume(count) != 1 || seen != sizeof(record))
+		{
+			fail(name, "record behind a stalled claim was not consumed", 0);
+		}
+		hold.store(false);
+		slow.join();
+		if (ring.consume(count) != 1 || seen != sizeof(record) + 16)
+		{
+			fail(name, "stalled record lost", 0);
+		}
+		std::printf("%-40s ok\n", name);
+	}
+
+	// The adaptive target must grow under a sustained backlog and fall back
+	// to 1 once the consumer keeps up, so light traffic is not held back.
+	inline void check_adaptive(const char* name)
+	{
+		queue<int, engine::ring> queue(std::size_t(1024));
+		auto produser = queue.produser();
+		AdaptiveBatchingConsumer<decltype(queue), 256> consumer(queue, std::chrono::milliseconds(1));
+		std::size_t delivered = 0;
+		auto handle = [&](std::span<int> batch) { delivered += batch.size(); };
+
+		auto start = std::chrono::steady_clock::now();
+		while (std::chrono::steady_clock::now() - start < std::chrono::milliseconds(20))
+		{
+			for (int i = 0; i < 128; ++i)
+			{
+				produser.push(i);
+			}
+			while (consumer.poll(handle) != 0)
+			{
+			}
+		}
+		consumer.flush(handle);
+		if (consumer.batch_size() < 16)
+		{
+			fail(name, "target did not grow under load", 0);
+		}
+
+		for (int i = 0; i < 16; ++i)
+		{
+			produser.push(i);
+			std::size_t before = delivered;
+			bool at_once = consumer.poll(handle) != 0;
+			while (delivered == before)
+			{
+				consumer.poll(handle);
+			}
+			consumer.poll(handle);
+			if (i >= 8 && !at_once)
+			{
+				fail(name, "light load still waits for a batch", 0);
+				break;
+			}
+		}
+		if (consumer.batch_size() != 1)
+		{
+			fail(name, "target did not fall after load", 0);
+		}
+		std::printf("%-40s ok\n", name);
+	}
+
+	// Records carry sizeof(Message) to max_size bytes.
+	template<CommitOrder Order>
+	void run_byte_ring(const char* name, const Config& config, std::size_t capacity, std::size_t max_size = 64)
+	{
+		for (unsigned round = 0; round < config.rounds; ++round)
+		{
+			std::uint32_t seed = config.seed + round;
+			ByteRing<Order> ring(capacity);
+			StartGate gate;
+			std::vector<std::thread> threads;
+			for (unsigned id = 0; id < config.producers; ++id)
+			{
+				threads.emplace_back([&, id]
+				{
+					rng().seed(seed * 31 + id);
+					gate.wait();
+					auto& random = rng();
+					std::vector<std::byte> bytes(max_size);
+					for (std::uint32_t seq = 0; seq < config.messages; ++seq)
+					{
+						// Variable sizes so records straddle the end of the ring.
+						std::size_t size = sizeof(Message) + random() % (max_size - sizeof(Message));
+						Message message{ id, seq };
+						std::memcpy(bytes.data(), &message, sizeof(message));
+						std::memset(bytes.data() + sizeof(message), static_cast<int>(seq & 0xff), size - sizeof(message));
+						std::span<const std::byte> record(bytes.data(), size);
+						bool streaming = random() % 4 == 0;
+						while (!(streaming ? ring.try_push_streaming(record) : ring.try_push(record)))
+						{
+							std::this_thread::yield();
+						}
+					}
+				});
+			}
+
+			Checker checker(name, config.producers, config.messages, seed);
+			gate.open();
+			while (checker.remaining() != 0 && failures == 0)
+			{
+				std::size_t consumed = ring.consume([&](std::span<const std::byte> record)
+				{
+					Message message;
+					std::memcpy(&message, record.data(), sizeof(message));
+					for (std::size_t i = sizeof(message); i < record.size(); ++i)
+					{
+						if (record[i] != static_cast<std::byte>(message.seq & 0xff))
+						{
+							fail(name, "torn record", seed);
+							break;
+						}
+					}
+					checker.see(message);
+				}, 1 + rng()() % 64);
+				if (consumed == 0)
+				{
+					std::this_thread::yield();
+				}
+			}
+			for (auto& thread : threads)
+			{
+				thread.join();
+			}
+			checker.finish();
+		}
+		std::printf("%-40s ok\n", name);
+	}
+
+	inline bool no_observer(auto&, OrderWatch&)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		return true;
+	}
+
+	inline bool walk_linked(auto& queue, OrderWatch& watch)
+	{
+		bool ordered = true;
+		Message front;
+		queue.engine().peek(front);
+		queue.engine().for_each([&](const Message& message) { ordered &= watch.see(message); });
+		return ordered;
+	}
+
+	inline bool walk_snapshot(auto& queue, OrderWatch& watch)
+	{
+#if defined(__SANITIZE_THREAD__)
+		(void)queue;
+		(void)watch;
+		std::this_thread::yield();
+		return true;
+#else
+		for (const Message& message : queue.engine().snapshot())
+		{
+			if (!watch.see(message))
+			{
+				return false;
+			}
+		}
+		return true;
+#endif
+	}
+
+	// Sample hand-over corner cases, single-threaded: a failed push or one of
+	// a prebuilt Traced must not leave its sample to the next Traced built on
+	// the thread, and a slot still in flight must not be claimed again.
+	inline void check_tracer(const char* name)
+	{
+		auto drain = [](auto& consumer, LatencyTracer& tracer, std::vector<std::uint64_t>& samples)
+		{
+			Traced<int> item;
+			while (consumer.pop(item))
+			{
+				samples.push_back(item.sample);
+				tracer.handled(item);
+			}
+		};
+
+		{
+			LatencyTracer tracer(8, 1);
+			queue<Traced<int>, engine::ring> queue(std::size_t(2));
+			auto produser = queue.produser(tracer.sampler());
+			auto consumer = queue.consumer(tracer.visibility());
+			std::vector<std::uint64_t> samples;
+			while (produser.emplace(1))
+			{
+			}
+			if (Traced<int>(42).sample != 0)
+			{
+				fail(name, "failed push leaked its sample", 0);
+			}
+			drain(consumer, tracer, samples);
+			if (!produser.push(Traced<int>(7)) || Traced<int>(42).sample != 0)
+			{
+				fail(name, "prebuilt push leaked its sample", 0);
+			}
+			drain(consumer, tracer, samples);
+			if (samples.size() != 3 || samples[0] == 0 || samples[1] == 0 || samples[2] != 0
+				|| tracer.for_each([](const LatencySample&) {}) != 2)
+			{
+				fail(name, "wrong samples after failed pushes", 0);
+			}
+		}
+
+		{
+			LatencyTracer tracer(2, 1);
+			queue<Traced<int>, engine::ring> queue(std::size_t(8));
+			auto produser = queue.produser(tracer.sampler());
+			auto consumer = queue.consumer(tracer.visibility());
+			std::vector<std::uint64_t> samples;
+			produser.emplace(1);
+			produser.emplace(2);
+			produser.emplace(3);
+			drain(consumer, tracer, samples);
+			produser.emplace(4);
+			drain(consumer, tracer, samples);
+			std::vector<std::uint64_t> expected{ 1, 2, 0, 4 };
+			if (samples != expected || tracer.for_each([](const LatencySample&) {}) != 2)
+			{
+				fail(name, "slot in flight was claimed again", 0);
+			}
+		}
+		std::printf("%-40s ok\n", name);
+	}
+
+	// Sampled latency tracing over a small ring, so sampled pushes also hit a
+	// full queue and retry: every every-th push of each producer must come out
+	// as one complete, ordered sample.
+	inline void run_tracer(const char* name, const Config& config)
+	{
+		constexpr std::uint32_t every = 5;
+		for (unsigned round = 0; round < config.rounds; ++round)
+		{
+			std::uint32_t seed = config.seed + round;
+			rng().seed(seed);
+			LatencyTracer tracer(1 << 16, every);
+			queue<Traced<Message>, engine::ring> queue(std::size_t(16));
+			StartGate gate;
+			std::vector<std::thread> threads;
+			for (unsigned id = 0; id < config.producers; ++id)
+			{
+				threads.emplace_back([&, id]
+				{
+					rng().seed(seed * 31 + id);
+					auto produser = queue.produser(tracer.sampler());
+					gate.wait();
+					for (std::uint32_t seq = 0; seq < config.messages; ++seq)
+					{
+						while (!produser.emplace(Message{ id, seq }))
+						{
+							std::this_thread::yield();
+						}
+					}
+				});
+			}
+
+			Checker checker(name, config.producers, config.messages, seed);
+			auto consumer = queue.consumer(tracer.visibility());
+			gate.open();
+			Traced<Message> item;
+			while (checker.remaining() != 0 && failures == 0)
+			{
+				if (consumer.pop(item))
+				{
+					checker.see(item.value);
+					tracer.handled(item);
+				}
+				else
+				{
+					std::this_thread::yield();
+				}
+			}
+			for (std::thread& thread : threads)
+			{
+				thread.join();
+			}
+			checker.finish();
+
+			std::size_t expected = std::min<std::size_t>(std::size_t(config.producers) * (config.messages / every), 1 << 16);
+			bool ordered = true;
+			std::size_t samples = tracer.for_each([&](const LatencySample& sample)
+			{
+				ordered = ordered && sample.push_start <= sample.push_commit && sample.push_start <= sample.visible
+					&& sample.visible <= sample.handled;
+			});
+			if (samples != expected)
+			{
+				fail(name, "wrong number of samples", seed);
+			}
+			if (!ordered)
+			{
+				fail(name, "sample timestamps out of order", seed);
+			}
+			if (tracer.chrome_trace().find("\"traceEvents\"") == std::string::npos)
+			{
+				fail(name, "malformed trace", seed);
+			}
+		}
+		std::printf("%-40s ok\n", name);
+	}
+
+	inline void run_all(const Config& config)
+	{
+		auto none = [](auto& queue, OrderWatch& watch) { return no_observer(queue, watch); };
+		auto linked = [](auto& queue, OrderWatch& watch) { return walk_linked(queue, watch); };
+		auto snapshot = [](auto& queue, OrderWatch& watch) { return walk_snapshot(queue, watch); };
+
+		check_kernels("copy kernels");
+		run_queue<queue<Message>>("linked", config, none);
+		run_queue<queue<Message, engine::linked<EpochReclaim<2, 64>>>>("linked epoch + observer", config, linked);
+		run_queue<queue<Message, engine::linked<>, wait::park<4>>>("linked park", config, none);
+		run_queue<queue<Message, engine::ring>>("ring 2 + snapshot", config, snapshot, std::size_t(2));
+		run_queue<queue<Message, engine::ring>>("ring 64 + snapshot", config, snapshot, std::size_t(64));
+		run_queue<queue<Message, engine::ring, wait::park<4>, overflow::block, stats::counters>>("ring park block", config, none, std::size_t(16));
+		run_queue<queue<Message, engine::ring, wait::umwait<>>>("ring umwait", config, none, std::size_t(64));
+
+		// No allocation: the engines only get memory from static storage or an
+		// arena whose upstream is null_memory_resource(), so any allocation
+		// past them throws. The arena holds every node a round allocates.
+		check_storage("ring storage checks");
+		using StaticRing = queue<Message, engine::ring>;
+		alignas(StaticRing::engine_type::storage_alignment) static std::byte storage[StaticRing::required_bytes(64)];
+		run_queue<StaticRing>("ring 64, static storage + snapshot", config, snapshot, std::size_t(64), std::span<std::byte>(storage));
+		std::vector<std::byte> buffer(std::size_t(config.producers) * config.messages * 64 + (1 << 16));
+		Arena arena(buffer);
+		run_queue<queue<Message, engine::ring, pmr_alloc>>("ring 64, pmr arena", config, none, std::size_t(64), &arena);
+		run_queue<queue<Message, engine::linked<>, pmr_alloc>>("linked, pmr arena", config, none, &arena);
+		run_batching<queue<Message, engine::ring>, 8>("ring batching", config, std::size_t(32));
+		run_batching<queue<Message>, 8>("linked batching", config);
+		run_batching<queue<Message, engine::ring, wait::park<4>>, 16, true>("ring adaptive batching", config, std::size_t(32));
+		run_batching<queue<Message>, 16, true>("linked adaptive batching", config);
+		check_adaptive("adaptive batch target");
+		run_byte_ring<CommitOrder::in_order>("byte ring in order", config, 256);
+		run_byte_ring<CommitOrder::any>("byte ring any order", config, 256);
+		check_byte_ring_stall("byte ring any order, stalled claim");
+		run_byte_ring<CommitOrder::in_order>("byte ring in order, large records", config, 4096, 1024);
+		run_byte_ring<CommitOrder::any>("byte ring any order, large records", config, 4096, 1024);
+		check_dedup("dedup");
+		check_token_bucket("token bucket");
+		check_codel("codel");
+		check_tracer("latency tracer hand-over");
+		run_tracer("ring latency tracer", config);
+	}
+
+}
+
+int main(int argc, char** argv)
+{
+	stress::Config config;
+	config.seed = std::random_device{}();
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		auto value = [&] { return i + 1 < argc ? static_cast<std::uint32_t>(std::strtoul(argv[++i], nullptr, 10)) : 0u; };
+		if (arg == "--seed")
+		{
+			config.seed = value();
+		}
+		else if (arg == "--rounds")
+		{
+			config.rounds = value();
+		}
+		else if (arg == "--messages")
+		{
+			config.messages = value();
+		}
+		else if (arg == "--litmus")
+		{
+			config.litmus = true;
+		}
+		else
+		{
+			std::fprintf(stderr, "usage: %s [--seed N] [--rounds N] [--messages N] [--litmus]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	std::printf("seed %u\n", config.seed);
+	if (config.litmus)
+	{
+		// No injected yields: the tiny runs rely on the threads really racing.
+		stress::yield_rate.store(0);
+		config.producers = 2;
+		config.messages = 4;
+		config.rounds = config.rounds * 1000;
+	}
+	stress::run_all(config);
+	// The main thread's tally is still live; the others have been added.
+	std::uint64_t pushes = stress::probe_pushes + stress::probe_tally.pushes;
+	std::uint64_t pops = stress::probe_pops + stress::probe_tally.pops;
+	if (stress::failures == 0 && (pushes == 0 || pushes != pops))
+	{
+		std::fprintf(stderr, "FAIL probes: %llu pushes, %llu pops\n", static_cast<unsigned long long>(pushes),
+			static_cast<unsigned long long>(pops));
+		++stress::failures;
+	}
+	return stress::failures == 0 ? 0 : 1;
+}